@@ -16,4 +16,7 @@ public:
   }
 };
 
+// root types of the region files codp tools know of
+typedef root_registry<CodProject> RootTypes;
+
 } // namespace cod::project
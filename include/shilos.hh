@@ -3,6 +3,50 @@
 
 #include "shilos/uuid.hh" // IWYU pragma: keep
 
+#include "shilos/uuid_text.hh" // IWYU pragma: keep
+
 #include "shilos/region.hh" // IWYU pragma: keep
 
 #include "shilos/dbmr.hh" // IWYU pragma: keep
+
+#include "shilos/poly.hh" // IWYU pragma: keep
+
+#include "shilos/clone.hh" // IWYU pragma: keep
+
+#include "shilos/sdbmr.hh" // IWYU pragma: keep
+
+#include "shilos/region_pool.hh" // IWYU pragma: keep
+
+#include "shilos/dirty_tracker.hh" // IWYU pragma: keep
+
+#include "shilos/durability.hh" // IWYU pragma: keep
+
+#include "shilos/bulk_io.hh" // IWYU pragma: keep
+
+#include "shilos/region_stream.hh" // IWYU pragma: keep
+
+#include "shilos/snapshot.hh" // IWYU pragma: keep
+
+#include "shilos/delta.hh" // IWYU pragma: keep
+
+#include "shilos/checksum.hh" // IWYU pragma: keep
+
+#include "shilos/fd_passing.hh" // IWYU pragma: keep
+
+#include "shilos/futex.hh" // IWYU pragma: keep
+
+#include "shilos/region_ring.hh" // IWYU pragma: keep
+
+#include "shilos/change_feed.hh" // IWYU pragma: keep
+
+#include "shilos/epoch.hh" // IWYU pragma: keep
+
+#include "shilos/mvcc.hh" // IWYU pragma: keep
+
+#include "shilos/hamt.hh" // IWYU pragma: keep
+
+#include "shilos/uuid_directory.hh" // IWYU pragma: keep
+
+#include "shilos/root_registry.hh" // IWYU pragma: keep
+
+#include "shilos/migration.hh" // IWYU pragma: keep
@@ -0,0 +1,181 @@
+
+#pragma once
+
+#include "./region.hh"
+
+#include <cstddef>
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace shilos {
+
+//
+// bulk asynchronous file io, for streaming whole region images at device bandwidth,
+// instead of faulting pages in/out one at a time through a mapping
+//
+// io_uring (on Linux) keeps queue_depth chunk reads/writes in flight, straight from/to the caller's memory, only direct
+// io of unaligned memory goes through registered (pinned) staging buffers, a pool of threads doing pread/pwrite is used
+// where io_uring is unavailable (other OSes, old kernels, seccomp'd)
+//
+// a bulk_io_session sets its ring up once, for all the transfers it does, the static bulk_io functions set one up
+// per call
+//
+struct bulk_io_options {
+  size_t chunk_size = size_t(1) << 20;
+  unsigned queue_depth = 32;
+  unsigned fallback_threads = 4;
+  bool use_io_uring = true;
+  // bypass the page cache, offsets and chunk_size must be multiples of the device block size then
+  bool direct = false;
+};
+
+class bulk_io_session {
+public:
+  explicit bulk_io_session(const bulk_io_options &opts = bulk_io_options());
+  ~bulk_io_session();
+
+  bulk_io_session(const bulk_io_session &) = delete;
+  bulk_io_session &operator=(const bulk_io_session &) = delete;
+
+  const bulk_io_options &options() const;
+  bool uses_io_uring() const;
+
+  // read len bytes at offset of fd into dst, throws on errors and on premature EOF
+  void read(int fd, void *dst, size_t len, off_t offset);
+  // write len bytes from src to fd at offset
+  void write(int fd, const void *src, size_t len, off_t offset);
+  // copy the first len bytes of src_fd to dst_fd, each chunk written as soon as it's read, with up to queue_depth
+  // chunks in flight, so reads overlap writes
+  void copy(int src_fd, int dst_fd, size_t len);
+
+private:
+  struct impl;
+  std::unique_ptr<impl> impl_;
+};
+
+class bulk_io {
+public:
+  typedef bulk_io_options options;
+
+  static bool io_uring_available();
+
+  // read len bytes at offset of fd into dst, throws on errors and on premature EOF
+  static void read(int fd, void *dst, size_t len, off_t offset, const options &opts = options());
+  // write len bytes from src to fd at offset
+  static void write(int fd, const void *src, size_t len, off_t offset, const options &opts = options());
+
+  // stream a whole file into another, e.g. to materialize a DBMR on another disk, a new dst_file gets the mode of
+  // src_file, throws std::invalid_argument if dst_file is src_file (by any path)
+  static void copy_file(const std::string &src_file, const std::string &dst_file, const options &opts = options());
+
+  enum class clone_method { reflink, copy_file_range, streamed };
+
+  // an independent copy of a file, sharing its extents copy-on-write where the filesystem can (FICLONE),
+  // else copied within the kernel (copy_file_range), else streamed with copy_file(), same checks as copy_file()
+  static clone_method clone_file(const std::string &src_file, const std::string &dst_file);
+
+  // open flags honoring opts.direct where supported
+  static int open_file(const std::string &file_name, int flags, const options &opts, mode_t mode = 0644);
+};
+
+// header fields of a region image on disk
+struct region_header {
+  size_t capacity;
+  size_t occupation;
+  size_t root_offset;
+  size_t file_size;
+};
+
+//
+// loading/saving of memory_region images with bulk_io
+//
+template <typename RT>
+  requires ValidMemRegionRootType<RT>
+class region_image {
+public:
+  // save the occupied part of a region as a DBMR file of the same capacity (the free tail left sparse)
+  static void save(const memory_region<RT> &region, const std::string &file_name,
+                   const bulk_io::options &opts = bulk_io::options()) {
+    bulk_io_session io(opts);
+    save(region, file_name, io);
+  }
+
+  // with the ring of a session, to save/load many images without setting one up for each
+  static void save(const memory_region<RT> &region, const std::string &file_name, bulk_io_session &io) {
+    int fd = bulk_io::open_file(file_name, O_CREAT | O_TRUNC | O_WRONLY, io.options());
+    try {
+      io.write(fd, &region, region.occupation(), 0);
+      // also trims the block padding of direct io
+      if (ftruncate(fd, region.capacity()) == -1) {
+        throw std::system_error(errno, std::system_category(), "Failed to resize file: " + file_name);
+      }
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+  }
+
+  // read and validate the header of a DBMR file
+  static region_header read_header(const std::string &file_name) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to open file: " + file_name);
+    }
+    struct stat statbuf;
+    alignas(memory_region<RT>) std::byte header[sizeof(memory_region<RT>)];
+    if (fstat(fd, &statbuf) == -1 || pread(fd, header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+      const int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "Failed to read region header: " + file_name);
+    }
+    close(fd);
+    const size_t file_size = statbuf.st_size;
+    const auto *region = reinterpret_cast<const memory_region<RT> *>(header);
+    if (region->occupation() > file_size || region->occupation() > region->capacity()) { // this is insane
+      throw std::logic_error("!?DBMR occupied more than the file size?!");
+    }
+    if (region->root_type_uuid() != RT::TYPE_UUID) {
+      throw std::runtime_error(std::string("Root Type mismatch: ") + region->root_type_uuid().to_string() +
+                               " vs expected " + RT::TYPE_UUID.to_string());
+    }
+    return region_header{region->capacity(), region->occupation(), region->root().offset(), file_size};
+  }
+
+  // load a DBMR file into an in-memory region with extra free capacity,
+  // the memory is allocated with std::allocator<std::byte>, of capacity() bytes, as alloc_region() does
+  static memory_region<RT> *load(const std::string &file_name, size_t extra_capacity = 0,
+                                 const bulk_io::options &opts = bulk_io::options()) {
+    bulk_io_session io(opts);
+    return load(file_name, extra_capacity, io);
+  }
+
+  static memory_region<RT> *load(const std::string &file_name, size_t extra_capacity, bulk_io_session &io) {
+    const region_header header = read_header(file_name);
+    const size_t occupation = header.occupation, capacity = header.capacity + extra_capacity;
+
+    std::allocator<std::byte> allocator;
+    std::byte *mem = allocator.allocate(capacity);
+    int fd = bulk_io::open_file(file_name, O_RDONLY, io.options());
+    try {
+      io.read(fd, mem, occupation, 0);
+    } catch (...) {
+      close(fd);
+      allocator.deallocate(mem, capacity);
+      throw;
+    }
+    close(fd);
+
+    auto *region = reinterpret_cast<memory_region<RT> *>(mem);
+    region->grow_capacity(capacity);
+    return region;
+  }
+};
+
+} // namespace shilos
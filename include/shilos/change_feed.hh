@@ -0,0 +1,210 @@
+
+#pragma once
+
+#include "./futex.hh"
+#include "./region.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace shilos {
+
+class change_listener;
+
+// a modified range of a region, by offset from the region start
+struct changed_range {
+  size_t offset;
+  size_t length;
+};
+
+//
+// change notification feed of a region shared by processes (a DBMR, or an anonymous one), so readers can learn what
+// a writer modified and refresh only that, instead of polling and re-reading the whole thing
+//
+// the feed lives in the region, typically a field of the root, it keeps a monotonically increasing version, and an
+// append-only log of the last LOG_SIZE modified ranges, each tagged with the version it was published at, a reader
+// remembers the last version it has seen, and asks for the ranges published since, if the log has wrapped past that
+// version meanwhile, the reader is told to refresh everything
+//
+// publishing is single-writer (as is allocating from a region), reading is lock-free and any number of readers can
+// wait for a new version on a futex in the region, readers never write to the feed, so they may map the region
+// read-only, while the writer pays a wake syscall per publication, batch publications to amortize that
+//
+// NOTE: a range is published after the writer modified it, readers may still observe a range mid-modification by a
+//       later write, which will be published in turn
+//
+template <size_t LOG_SIZE = 1024> class change_feed {
+  static_assert(LOG_SIZE >= 2 && (LOG_SIZE & (LOG_SIZE - 1)) == 0, "log size must be a power of 2");
+
+  friend class change_listener;
+
+  struct entry {
+    uint64_t version; // 0 while being (re)written
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  alignas(64) uint64_t version_;
+  alignas(64) uint32_t seq_; // the futex word, bumped with each publication
+  alignas(64) entry log_[LOG_SIZE];
+
+  template <typename I> static std::atomic_ref<I> ref(I &i) { return std::atomic_ref<I>(i); }
+  template <typename I> static std::atomic_ref<I> ref(const I &i) { return std::atomic_ref<I>(const_cast<I &>(i)); }
+
+  void notify() {
+    ref(seq_).fetch_add(1, std::memory_order_release);
+    futex_wake(&seq_, INT32_MAX);
+  }
+
+  void append(uint64_t v, size_t offset, size_t length) {
+    entry &e = log_[v & (LOG_SIZE - 1)];
+    // seqlock style, invalidate the slot before overwriting it, readers validate the version around their copy
+    ref(e.version).store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    ref(e.offset).store(offset, std::memory_order_relaxed);
+    ref(e.length).store(length, std::memory_order_relaxed);
+    ref(e.version).store(v, std::memory_order_release);
+  }
+
+public:
+  // a length meaning everything from the offset on changed
+  static constexpr size_t WHOLE = SIZE_MAX;
+
+  change_feed() : version_(0), seq_(0), log_{} {}
+
+  static constexpr size_t log_size() { return LOG_SIZE; }
+
+  // current version, 0 before anything was published
+  uint64_t version() const { return ref(version_).load(std::memory_order_acquire); }
+
+  // publish a modified range, returns the new version
+  uint64_t publish(size_t offset, size_t length) {
+    const uint64_t v = ref(version_).load(std::memory_order_relaxed) + 1;
+    append(v, offset, length);
+    ref(version_).store(v, std::memory_order_release);
+    notify();
+    return v;
+  }
+
+  // publish a batch of modified ranges with a single wake up, returns the new version
+  uint64_t publish(const std::vector<changed_range> &ranges) {
+    uint64_t v = ref(version_).load(std::memory_order_relaxed);
+    if (ranges.empty())
+      return v;
+    for (const auto &r : ranges) {
+      append(++v, r.offset, r.length);
+      // readers may start consuming the batch early, the log is append-only anyway
+      ref(version_).store(v, std::memory_order_release);
+    }
+    notify();
+    return v;
+  }
+
+  // publish the modification of an object in the region
+  template <typename VT, typename RT> uint64_t publish(const global_ptr<VT, RT> &obj, size_t length = sizeof(VT)) {
+    return publish(obj.offset(), length);
+  }
+
+  // have readers refresh everything, e.g. after a bulk rewrite
+  uint64_t publish_all() { return publish(0, WHOLE); }
+
+  // collect the ranges published after version `since` into out, and advance since to the version they bring the
+  // reader to, returns false if some of them have been dropped from the log already, the reader should then refresh
+  // everything (out is left empty in that case, and since is still advanced)
+  bool changes_since(uint64_t &since, std::vector<changed_range> &out) const {
+    out.clear();
+    const uint64_t current = version();
+    if (current <= since)
+      return true;
+    if (current - since > LOG_SIZE) {
+      since = current;
+      return false;
+    }
+    for (uint64_t v = since + 1; v <= current; ++v) {
+      const entry &e = log_[v & (LOG_SIZE - 1)];
+      const uint64_t before = ref(e.version).load(std::memory_order_acquire);
+      const uint64_t offset = ref(e.offset).load(std::memory_order_relaxed);
+      const uint64_t length = ref(e.length).load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      const uint64_t after = ref(e.version).load(std::memory_order_relaxed);
+      if (before != v || after != v) {
+        // the writer has lapped us while we were reading
+        out.clear();
+        since = version();
+        return false;
+      }
+      if (length == WHOLE) {
+        out.clear();
+        since = current;
+        return false;
+      }
+      out.push_back({offset, length});
+    }
+    since = current;
+    return true;
+  }
+
+  // wait for the version to move past `since`, returns the current version, which equals since on timeout
+  // (a negative timeout waits forever)
+  uint64_t wait_for_change(uint64_t since, std::chrono::nanoseconds timeout = std::chrono::nanoseconds(-1)) const {
+    const bool forever = timeout.count() < 0;
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+      // the word is bumped after the version is stored, reading it first misses no publication
+      const uint32_t seq = ref(seq_).load(std::memory_order_acquire);
+      const uint64_t current = version();
+      if (current != since)
+        return current;
+      std::chrono::nanoseconds remaining(-1);
+      if (!forever) {
+        remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining.count() <= 0)
+          return current;
+      }
+      futex_wait(&seq_, seq, remaining);
+    }
+  }
+};
+
+//
+// bridges a change feed to an eventfd, for readers driven by an event loop (poll/epoll/io_uring), a background thread
+// waits on the feed and signals the eventfd whenever the version moves, the reader then drains the eventfd and calls
+// changes_since() on the feed
+//
+class change_listener {
+  const uint32_t *word_;
+  std::function<uint64_t()> version_;
+  int event_fd_;
+  int notify_fd_; // the write end, when a pipe stands in for the eventfd
+  std::atomic<bool> stop_;
+  std::atomic<bool> exited_; // the waiter is past its last futex wait
+  std::thread waiter_;
+
+  change_listener(const uint32_t *word, std::function<uint64_t()> version, uint64_t since);
+
+  void run(uint64_t since);
+
+public:
+  // start listening for versions after since, the feed must outlive the listener
+  template <size_t LOG_SIZE>
+  change_listener(const change_feed<LOG_SIZE> &feed, uint64_t since)
+      : change_listener(&feed.seq_, [&feed] { return feed.version(); }, since) {}
+
+  ~change_listener();
+
+  change_listener(const change_listener &) = delete;
+  change_listener &operator=(const change_listener &) = delete;
+
+  // readable when the feed has moved, non-blocking
+  int fd() const { return event_fd_; }
+
+  // consume the pending notification, returns whether there was one
+  bool drain();
+};
+
+} // namespace shilos
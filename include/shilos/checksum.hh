@@ -0,0 +1,75 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace shilos {
+
+// CRC32C (Castagnoli), with the implementation picked at runtime: SSE4.2 on x86-64, the CRC extension on AArch64,
+// slicing-by-8 tables elsewhere
+uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0);
+
+// name of the implementation crc32c() dispatches to
+const char *crc32c_impl();
+
+//
+// CRC32C checksums of fixed size chunks of a memory range, e.g. the occupied part of a region,
+// persisted in a sidecar file, so a torn or corrupted region file is detected before its garbage pointers are followed
+//
+// chunks are checksummed and verified in parallel, at memory bandwidth, and verification can also be done lazily,
+// chunk by chunk, before first touching parts of a huge region
+//
+class chunk_checksums {
+public:
+  typedef std::pair<size_t, size_t> range; // [begin, end) offsets
+
+  static constexpr size_t DEFAULT_CHUNK_SIZE = size_t(64) << 10;
+
+  explicit chunk_checksums(size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+  size_t chunk_size() const { return chunk_size_; }
+  size_t length() const;
+
+  // checksum all chunks of [0, length), with threads, 0 for the hardware concurrency
+  void compute(const std::byte *base, size_t length, unsigned threads = 0);
+
+  // re-checksum the chunks overlapping ranges, and those past the previous length, the range is now length long
+  void update(const std::byte *base, size_t length, const std::vector<range> &ranges);
+
+  // [begin, end) reads as zeros now (a punched hole e.g.), chunks wholly within get the checksum of zeros without being
+  // read (faulting the hole in), the others overlapping it are re-checksummed
+  void zeroed(const std::byte *base, size_t begin, size_t end);
+
+  // offsets of the chunks mismatching their checksums, verified in parallel
+  std::vector<size_t> verify(const std::byte *base, unsigned threads = 0) const;
+
+  // whether the chunks overlapping [offset, offset + len) match, each chunk verified once only
+  bool verify_range(const std::byte *base, size_t offset, size_t len) const;
+
+  // written to a temporary file synced and renamed into place, so the sidecar is never seen half updated, even after
+  // a crash
+  void save(const std::string &file_name) const;
+  // false if the file doesn't exist, throws if it's malformed
+  bool load(const std::string &file_name);
+
+private:
+  size_t chunk_size_;
+  size_t length_ = 0;
+  std::vector<uint32_t> crcs_;
+  // chunks verified by verify_range()
+  mutable std::unique_ptr<std::atomic<uint64_t>[]> verified_;
+  // flushes update from background threads, while readers verify
+  mutable std::mutex mutex_;
+
+  uint32_t chunk_crc(const std::byte *base, size_t chunk) const;
+  void reset_verified();
+};
+
+} // namespace shilos
@@ -0,0 +1,188 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <unordered_set>
+#include <vector>
+
+#include "./poly.hh"
+#include "./region.hh"
+
+namespace shilos {
+
+//
+// deep copy of the subgraph reachable from a global_ptr, into another (or the same) memory region
+//
+// the reachable objects are discovered by following the regional_ptr_map of each record type, then objects adjacent in
+// the source region (bump allocated together, as is usually the case) are coalesced into runs, each run is copied with
+// a single memcpy, keeping its internal layout, so every pointer target within a run relocates by the same delta
+//
+// the final fix-up pass rewrites all copied regional_ptr fields from a flat array of (slot, delta) pairs
+//
+template <typename RT1, typename RT2> class subgraph_cloner {
+public:
+  template <typename VT>
+  static global_ptr<VT, RT2> clone(const global_ptr<VT, RT1> &src, memory_region<RT2> &dst) {
+    if (!src)
+      return dst.template null<VT>();
+    subgraph_cloner cloner(*src.region(), dst);
+    cloner.template discover<VT>(src.offset());
+    cloner.scan_all();
+    cloner.copy_runs();
+    cloner.fix_up();
+    return global_ptr<VT, RT2>::from_offset(&dst, src.offset() + cloner.delta_of(src.offset()));
+  }
+
+private:
+  typedef void (*scan_fn)(subgraph_cloner &, size_t offset);
+
+  struct object_info {
+    size_t offset;
+    size_t size;
+    size_t align;
+    scan_fn scan;
+  };
+
+  // an object by its offset and type, as scan<T> identifies it, an interior ptr to the first member of a record shares
+  // the offset of the record
+  typedef std::pair<size_t, scan_fn> object_key;
+  struct object_key_hash {
+    size_t operator()(const object_key &key) const {
+      return std::hash<size_t>()(key.first) * 31 + std::hash<scan_fn>()(key.second);
+    }
+  };
+
+  struct run_info {
+    size_t src_begin;
+    size_t src_end;
+    size_t align;
+    intptr_t delta;
+  };
+
+  const memory_region<RT1> &src_;
+  memory_region<RT2> &dst_;
+
+  std::vector<object_info> objects_;
+  std::unordered_set<object_key, object_key_hash> seen_;
+  std::vector<run_info> runs_;
+  // source offsets of all regional_ptr fields inside the discovered objects
+  std::vector<size_t> slots_;
+
+  subgraph_cloner(const memory_region<RT1> &src, memory_region<RT2> &dst) : src_(src), dst_(dst) {}
+
+  const std::byte *src_base() const { return reinterpret_cast<const std::byte *>(&src_); }
+  std::byte *dst_base() const { return reinterpret_cast<std::byte *>(&dst_); }
+
+  template <typename T> void discover(size_t offset) {
+    static_assert(RegionSafe<T>, "!?only region safe types can be cloned across regions?!");
+    static_assert(!holds_opaque_offsets<T>(), "!?records holding bare offsets (OPAQUE_OFFSETS) can not be cloned?!");
+    if (offset == 0)
+      return;
+    if (offset + sizeof(T) > src_.occupation()) {
+      throw std::logic_error("!?regional ptr out of occupied range?!");
+    }
+    if constexpr (PolyBase<T>) { // follow the concrete record type instead
+      const poly_object *obj = reinterpret_cast<const poly_object *>(src_base() + offset);
+      T::POLY_FAMILY::visit_type(T::POLY_FAMILY::tag_of(*obj),
+                                 [&](auto type) { discover<typename decltype(type)::type>(offset); });
+      return;
+    }
+    if (!seen_.insert(object_key(offset, &subgraph_cloner::scan<T>)).second)
+      return;
+    objects_.push_back(object_info{offset, sizeof(T), alignof(T),
+                                   regional_ptr_map<T>::pointer_free ? nullptr : &subgraph_cloner::scan<T>});
+  }
+
+  template <typename T> static void scan(subgraph_cloner &cloner, size_t offset) {
+    using map = regional_ptr_map<T>;
+    const auto &field_offsets = map::offsets;
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (cloner.template follow<typename map::template target_type<I>>(offset + field_offsets[I]), ...);
+    }(std::make_index_sequence<map::count>());
+  }
+
+  template <typename F> void follow(size_t slot) {
+    slots_.push_back(slot);
+    discover<F>(reinterpret_cast<const regional_ptr<F> *>(src_base() + slot)->offset());
+  }
+
+  void scan_all() {
+    // objects_ grows as we scan, so iterate by index
+    for (size_t i = 0; i < objects_.size(); ++i) {
+      if (objects_[i].scan) // pointer free objects are leaves
+        objects_[i].scan(*this, objects_[i].offset);
+    }
+  }
+
+  void copy_runs() {
+    std::sort(objects_.begin(), objects_.end(),
+              [](const object_info &a, const object_info &b) { return a.offset < b.offset; });
+
+    // coalesce objects separated only by alignment padding (or overlapping, for interior ptrs) into runs
+    for (const auto &obj : objects_) {
+      if (!runs_.empty() && obj.offset < runs_.back().src_end + obj.align) {
+        auto &run = runs_.back();
+        run.src_end = std::max(run.src_end, obj.offset + obj.size);
+        run.align = std::max(run.align, obj.align);
+      } else {
+        runs_.push_back(run_info{obj.offset, obj.offset + obj.size, obj.align, 0});
+      }
+    }
+
+    for (auto &run : runs_) {
+      // keep the run start at the same position modulo its max alignment,
+      // so every object inside stays properly aligned after the bulk copy
+      const size_t lead = run.src_begin % run.align;
+      void *ptr = dst_.allocate(lead + run.src_end - run.src_begin, run.align);
+      const size_t dst_begin = reinterpret_cast<std::byte *>(ptr) - dst_base() + lead;
+      std::memcpy(dst_base() + dst_begin, src_base() + run.src_begin, run.src_end - run.src_begin);
+      run.delta = static_cast<intptr_t>(dst_begin) - static_cast<intptr_t>(run.src_begin);
+    }
+  }
+
+  intptr_t delta_of(size_t src_offset) const {
+    if (src_offset == 0)
+      return 0; // nullptr stays null
+    auto it = std::upper_bound(runs_.begin(), runs_.end(), src_offset,
+                               [](size_t offset, const run_info &run) { return offset < run.src_begin; });
+    assert(it != runs_.begin());
+    --it;
+    assert(src_offset < it->src_end);
+    return it->delta;
+  }
+
+  void fix_up() {
+    // a slot is scanned once per type seen at its record's offset, it must be adjusted once only
+    std::sort(slots_.begin(), slots_.end());
+    slots_.erase(std::unique(slots_.begin(), slots_.end()), slots_.end());
+
+    const size_t n = slots_.size();
+    std::vector<size_t *> dst_slots(n);
+    std::vector<intptr_t> deltas(n);
+
+    // resolve pass: locate each copied slot and the delta of its target
+    auto run = runs_.begin();
+    for (size_t i = 0; i < n; ++i) {
+      while (slots_[i] >= run->src_end)
+        ++run;
+      dst_slots[i] = reinterpret_cast<size_t *>(dst_base() + slots_[i] + run->delta);
+      deltas[i] = delta_of(*dst_slots[i]);
+    }
+
+    // rewrite pass: branch-free over flat arrays
+    for (size_t i = 0; i < n; ++i) {
+      *dst_slots[i] += deltas[i];
+    }
+  }
+};
+
+// clone everything reachable from src into dst, returning the pointer to the copy of src's target
+template <typename VT, typename RT1, typename RT2>
+global_ptr<VT, RT2> clone_subgraph(const global_ptr<VT, RT1> &src, memory_region<RT2> &dst) {
+  return subgraph_cloner<RT1, RT2>::clone(src, dst);
+}
+
+} // namespace shilos
@@ -1,10 +1,20 @@
 
 #pragma once
 
+#include "./bulk_io.hh"
+#include "./checksum.hh"
+#include "./dirty_tracker.hh"
+#include "./durability.hh"
+#include "./fd_passing.hh"
 #include "./region.hh"
+#include "./snapshot.hh"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <exception>
 #include <fcntl.h>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <sys/fcntl.h>
@@ -23,21 +33,75 @@ protected:
   std::string file_name_;
 
 private:
+  bool anonymous_; // no file behind file_name_, see create_anonymous()
   int fd_;
   memory_region<RT> *region_;
   bool constrict_on_close_;
+  std::unique_ptr<dirty_tracker> dirty_tracker_;
+  durability_service::target_id durability_target_ = 0;
+  std::unique_ptr<fork_snapshot> snapshot_;
+  bool snapshot_tracking_ = false; // dirty_tracker_ created only for snapshot_
+  std::unique_ptr<chunk_checksums> checksums_;
 
   // internal ctor to be used by other (mostly static) ctors
-  DBMR(const std::string &file_name, int fd, memory_region<RT> *region)
-      : file_name_(file_name), fd_(fd), region_(region), constrict_on_close_(false) {}
+  DBMR(const std::string &file_name, int fd, memory_region<RT> *region, bool anonymous = false)
+      : file_name_(file_name), anonymous_(anonymous), fd_(fd), region_(region), constrict_on_close_(false) {}
+
+  void require_file(const char *what) const {
+    if (anonymous_) {
+      throw std::logic_error(std::string("!?") + what + " of an anonymous DBMR, it has no file name?!");
+    }
+  }
+
+  // map and validate the region in a fd, closing the fd on failures
+  static memory_region<RT> *map_fd(int fd, bool writable) {
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+      const int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "Failed to stat fd: " + std::to_string(fd));
+    }
+    const size_t size = statbuf.st_size;
+    if (size < sizeof(memory_region<RT>)) {
+      close(fd);
+      throw std::runtime_error("Not a region in fd: " + std::to_string(fd));
+    }
+#ifdef F_GET_SEALS
+    // the sender shrinking it later would SIGBUS accesses past the new end, only memory sealed at its size is mapped
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+      close(fd);
+      throw std::runtime_error("Size not sealed (see seal_size()) of fd: " + std::to_string(fd));
+    }
+#endif
+    void *mapped_addr = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped_addr == MAP_FAILED) {
+      const int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "Failed to mmap fd: " + std::to_string(fd));
+    }
+    auto *region = static_cast<memory_region<RT> *>(mapped_addr);
+    if (region->occupation() > size || region->capacity() > size) { // this is insane
+      munmap(mapped_addr, size);
+      close(fd);
+      throw std::logic_error("!?DBMR occupied more than the file size?!");
+    }
+    if (region->root_type_uuid() != RT::TYPE_UUID) {
+      munmap(mapped_addr, size);
+      close(fd);
+      throw std::runtime_error(std::string("Root Type mismatch: ") + region->root_type_uuid().to_string() +
+                               " vs expected " + RT::TYPE_UUID.to_string());
+    }
+    return region;
+  }
 
 public:
   // writable ctor
   DBMR(const std::string &file_name, size_t reserve_free_capacity)
-      : file_name_(file_name), fd_(-1), region_(nullptr), constrict_on_close_(false) {
+      : file_name_(file_name), anonymous_(false), fd_(-1), region_(nullptr), constrict_on_close_(false) {
     size_t file_size = 0;
 
-    int fd_ = open(file_name.c_str(), O_RDWR);
+    fd_ = open(file_name.c_str(), O_RDWR);
     if (fd_ == -1) {
       throw std::system_error(errno, std::system_category(), "Failed to open file: " + file_name);
     }
@@ -77,7 +141,7 @@ public:
         close(fd_);
         throw std::system_error(errno, std::system_category(), "Failed to resize file: " + file_name);
       }
-      region_->capacity_ = file_size = new_file_size;
+      file_size = new_file_size;
 
       mapped_addr = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
       if (mapped_addr == MAP_FAILED) {
@@ -86,10 +150,63 @@ public:
       }
 
       region_ = static_cast<memory_region<RT> *>(mapped_addr);
+      region_->capacity_ = file_size;
     }
   }
 
-  ~DBMR() {
+  // no copying, a DBMR owns its file descriptor and mapping
+  DBMR(const DBMR &) = delete;
+  DBMR &operator=(const DBMR &) = delete;
+
+  DBMR(DBMR &&other) noexcept
+      : file_name_(std::move(other.file_name_)), anonymous_(other.anonymous_), fd_(other.fd_), region_(other.region_),
+        constrict_on_close_(other.constrict_on_close_), dirty_tracker_(std::move(other.dirty_tracker_)),
+        durability_target_(other.durability_target_), snapshot_(std::move(other.snapshot_)),
+        snapshot_tracking_(other.snapshot_tracking_), checksums_(std::move(other.checksums_)) {
+    other.durability_target_ = 0;
+    other.fd_ = -1;
+    other.region_ = nullptr;
+  }
+
+  DBMR &operator=(DBMR &&other) noexcept {
+    if (this != &other) {
+      release();
+      file_name_ = std::move(other.file_name_);
+      anonymous_ = other.anonymous_;
+      fd_ = other.fd_;
+      region_ = other.region_;
+      constrict_on_close_ = other.constrict_on_close_;
+      dirty_tracker_ = std::move(other.dirty_tracker_);
+      durability_target_ = other.durability_target_;
+      snapshot_ = std::move(other.snapshot_);
+      snapshot_tracking_ = other.snapshot_tracking_;
+      checksums_ = std::move(other.checksums_);
+      other.durability_target_ = 0;
+      other.fd_ = -1;
+      other.region_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~DBMR() { release(); }
+
+private:
+  void release() {
+    try {
+      wait_snapshot();
+    } catch (const std::exception &exc) {
+      std::cerr << "*** Failed to snapshot file: " << file_name_ << ": " << exc.what() << std::endl;
+    }
+    if (durability_target_) {
+      try {
+        durability_service::instance().unregister_target(durability_target_);
+      } catch (const std::exception &exc) {
+        std::cerr << "*** Failed to sync file: " << file_name_ << ": " << exc.what() << std::endl;
+      }
+      durability_target_ = 0;
+    }
+    dirty_tracker_.reset(); // flushes, and stops write faulting
+    checksums_.reset();
     if (region_) {
       assert(fd_ != -1);
       const size_t occupation = region_->occupation(),
@@ -105,8 +222,12 @@ public:
     if (fd_ != -1) {
       close(fd_);
     }
+    region_ = nullptr;
+    fd_ = -1;
   }
 
+public:
+
   // readonly ctor
   static const DBMR<RT> read(const std::string &file_name) {
     int fd = open(file_name.c_str(), O_RDONLY);
@@ -147,10 +268,102 @@ public:
     return DBMR<RT>(file_name, fd, region);
   }
 
+  // anonymous shared memory ctor, for zero-copy exchange of transient data between processes, with no page cache
+  // writeback, seal_size() it, hand fd() to another process with send_fd() over a UNIX socket, and map it there with
+  // attach()
+  //
+  // NOTE: file name based operations (clone_to(), checksummed() e.g.) throw std::logic_error, there's no file name
+  template <typename... Args>
+  static DBMR<RT> create_anonymous(const std::string &name, size_t free_capacity, Args &&...args) {
+#ifdef __linux__
+    int fd = memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to create memfd: " + name);
+    }
+#else
+    // a POSIX shm object unlinked right away is as anonymous
+    const std::string shm_name = "/shilos-" + std::to_string(getpid()) + "-" + name;
+    int fd = shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to create shm: " + shm_name);
+    }
+    shm_unlink(shm_name.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    const size_t size = sizeof(memory_region<RT>) + sizeof(RT) + free_capacity;
+    if (ftruncate(fd, size) == -1) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), "Failed to resize memfd: " + name);
+    }
+    void *mapped_addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped_addr == MAP_FAILED) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), "Failed to mmap memfd: " + name);
+    }
+
+    auto *region = static_cast<memory_region<RT> *>(mapped_addr);
+    new (region) memory_region<RT>(size, std::forward<Args>(args)...);
+
+    return DBMR<RT>("memfd:" + name, fd, region, true);
+  }
+
+  // map a region from a fd, of an anonymous DBMR received with recv_fd() e.g., taking ownership of the fd, its size
+  // must be sealed (see seal_size()), so the sender can't shrink it under the mapping
+  //
+  // NOTE: where sealing isn't supported (not Linux), the mapping is bounded by the size at attach time only
+  static DBMR<RT> attach(int fd) { return DBMR<RT>("fd:" + std::to_string(fd), fd, map_fd(fd, true), true); }
+  static const DBMR<RT> attach_readonly(int fd) {
+    return DBMR<RT>("fd:" + std::to_string(fd), fd, map_fd(fd, false), true);
+  }
+
+  int fd() const { return fd_; }
+
+  // forbid resizing the shared memory from now on, so processes it's been handed to can trust its size,
+  // constrict_on_close() fails afterwards, throws where sealing isn't supported (not Linux, or not a memfd)
+  DBMR<RT> &seal_size() {
+#ifdef F_ADD_SEALS
+    if (fcntl(fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to seal: " + file_name_);
+    }
+#else
+    throw std::system_error(ENOTSUP, std::system_category(), "Failed to seal (not supported): " + file_name_);
+#endif
+    return *this;
+  }
+
+  // readonly ctor verifying the region against its checksums sidecar (see checksummed()),
+  // eagerly over all chunks in parallel, throwing on mismatches, or lazily with verify_range() before touching parts
+  static const DBMR<RT> read_verified(const std::string &file_name, bool eager = true, unsigned threads = 0) {
+    auto checksums = std::make_unique<chunk_checksums>();
+    if (!checksums->load(checksums_file(file_name))) {
+      throw std::runtime_error("Missing checksums: " + checksums_file(file_name));
+    }
+    DBMR<RT> dbmr = read(file_name);
+    // a file rolled back or truncated behind its sidecar (or a corrupt sidecar) would have chunks read past the mapping
+    struct stat statbuf;
+    if (fstat(dbmr.fd_, &statbuf) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to stat file: " + file_name);
+    }
+    if (checksums->length() > size_t(statbuf.st_size)) {
+      throw std::runtime_error("Checksums longer than file: " + file_name + " (" + std::to_string(checksums->length()) +
+                               " vs " + std::to_string(statbuf.st_size) + " bytes)");
+    }
+    dbmr.checksums_ = std::move(checksums);
+    if (eager) {
+      const std::vector<size_t> bad = dbmr.verify(threads);
+      if (!bad.empty()) {
+        throw std::runtime_error("Checksum mismatch in file: " + file_name + " at offset " + std::to_string(bad[0]) +
+                                 (bad.size() > 1 ? " and " + std::to_string(bad.size() - 1) + " more chunks" : ""));
+      }
+    }
+    return dbmr;
+  }
+
   // creation ctor
   template <typename... Args>
   static DBMR<RT> create(const std::string &file_name, size_t free_capacity, Args &&...args) {
-    int fd = open(file_name.c_str(), O_CREAT | O_RDWR);
+    int fd = open(file_name.c_str(), O_CREAT | O_RDWR, 0644);
     if (fd == -1) {
       throw std::system_error(errno, std::system_category(), "Failed to create file: " + file_name);
     }
@@ -179,6 +392,226 @@ public:
     return *this;
   }
 
+  // track dirty pages via write faults, so flush() syncs only pages written since the last flush,
+  // with a positive flush_latency, a background thread flushes at least that often
+  DBMR<RT> &track_dirty(std::chrono::milliseconds flush_latency = std::chrono::milliseconds(0)) {
+    if (!dirty_tracker_) {
+      dirty_tracker_ = std::make_unique<dirty_tracker>(region_, region_->capacity());
+    }
+    snapshot_tracking_ = false; // tracking on from now on
+    if (flush_latency.count() > 0) {
+      dirty_tracker_->start_flusher(flush_latency);
+    } else {
+      dirty_tracker_->stop_flusher();
+    }
+    if (durability_target_) { // sync through the tracker from now on
+      durable(false);
+      durable(true);
+    }
+    return *this;
+  }
+
+  bool tracking_dirty() const { return dirty_tracker_ != nullptr; }
+  size_t dirty_pages() const { return dirty_tracker_ ? dirty_tracker_->dirty_pages() : 0; }
+
+  // msync the dirty pages, or all occupied pages when not tracking, returns the number of bytes synced
+  size_t flush() {
+    if (dirty_tracker_)
+      return dirty_tracker_->flush();
+    const size_t page_size = dirty_tracker::page_size();
+    const size_t length = (region_->occupation() + page_size - 1) / page_size * page_size;
+    if (msync(reinterpret_cast<void *>(region_), std::min(length, region_->capacity()), MS_SYNC) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to msync file: " + file_name_);
+    }
+    return length;
+  }
+
+  static std::string checksums_file(const std::string &file_name) { return file_name + ".crc"; }
+
+  // maintain CRC32C checksums of the occupied chunks in the sidecar file checksums_file(), updated by every flush
+  // (background and durability service ones included), so read_verified() can detect torn or corrupted files,
+  // turns dirty tracking on, and checksums the current content afresh
+  //
+  // NOTE: chunks written after a flush synced them but before their checksums got updated read back mismatching
+  //       after a crash right then, so mismatches point at chunks in flux at a crash, as well as at corruption
+  DBMR<RT> &checksummed(size_t chunk_size = chunk_checksums::DEFAULT_CHUNK_SIZE) {
+    require_file("checksums");
+    if (checksums_)
+      return *this;
+    if (!dirty_tracker_ || snapshot_tracking_)
+      track_dirty();
+    dirty_tracker_->flush(); // checksum what's on disk
+    auto checksums = std::make_unique<chunk_checksums>(chunk_size);
+    checksums->compute(reinterpret_cast<const std::byte *>(region_), region_->occupation());
+    checksums->save(checksums_file(file_name_));
+    // capture by value, stays valid across moves of this DBMR
+    dirty_tracker_->on_flushed([file_name = checksums_file(file_name_), region = region_,
+                                checksums = checksums.get()](const std::vector<dirty_tracker::range> &ranges) {
+      checksums->update(reinterpret_cast<const std::byte *>(region), region->occupation(), ranges);
+      checksums->save(file_name);
+    });
+    checksums_ = std::move(checksums);
+    return *this;
+  }
+
+  // offsets of the chunks mismatching their checksums, verified in parallel
+  std::vector<size_t> verify(unsigned threads = 0) const {
+    if (!checksums_) {
+      throw std::logic_error("!?verifying a DBMR without checksums?!");
+    }
+    return checksums_->verify(reinterpret_cast<const std::byte *>(region_), threads);
+  }
+
+  // verify the chunks overlapping [offset, offset + length), each chunk verified once only
+  bool verify_range(size_t offset, size_t length) const {
+    if (!checksums_) {
+      throw std::logic_error("!?verifying a DBMR without checksums?!");
+    }
+    return checksums_->verify_range(reinterpret_cast<const std::byte *>(region_), offset, length);
+  }
+
+  // register with the process-wide durability service, so commit() marks group committed durability points
+  DBMR<RT> &durable(bool durable = true) {
+    auto &service = durability_service::instance();
+    if (!durable) {
+      if (durability_target_) {
+        service.unregister_target(durability_target_);
+        durability_target_ = 0;
+      }
+    } else if (!durability_target_) {
+      // capture by value, stays valid across moves of this DBMR
+      durability_target_ = service.register_target(
+          [file_name = file_name_, region = region_, tracker = snapshot_tracking_ ? nullptr : dirty_tracker_.get()] {
+            if (tracker) {
+              tracker->flush();
+              return;
+            }
+            const size_t page_size = dirty_tracker::page_size();
+            const size_t length = (region->occupation() + page_size - 1) / page_size * page_size;
+            if (msync(reinterpret_cast<void *>(region), std::min(length, region->capacity()), MS_SYNC) == -1) {
+              throw std::system_error(errno, std::system_category(), "Failed to msync file: " + file_name);
+            }
+          });
+    }
+    return *this;
+  }
+
+  // mark a commit point, the returned ticket can be waited for with durability_service::wait_durable()
+  durability_service::ticket commit() {
+    if (!durability_target_) {
+      throw std::logic_error("!?commit to a DBMR not made durable?!");
+    }
+    return durability_service::instance().commit(durability_target_);
+  }
+
+  // mark a commit point and wait for it to be durable, along with concurrent commits of the batch
+  void commit_and_wait() { durability_service::instance().wait_durable(commit()); }
+
+  // release the disk blocks (and cached pages) of a large freed extent amid the region, the extent reads back as
+  // zeros afterwards, only whole pages within [offset, offset + length) are released, returns the bytes released
+  size_t punch_hole(size_t offset, size_t length) {
+    if (offset < region_->ro_offset_ + sizeof(RT) || offset > region_->capacity() ||
+        length > region_->capacity() - offset) {
+      throw std::out_of_range("!?punching a hole outside the free space of DBMR?!");
+    }
+    const size_t page_size = dirty_tracker::page_size();
+    const size_t begin = (offset + page_size - 1) / page_size * page_size,
+                 end = (offset + length) / page_size * page_size;
+    if (end <= begin)
+      return 0;
+    bool punched = false;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    punched = fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin) == 0;
+    if (!punched && errno != EOPNOTSUPP && errno != ENOSYS) {
+      throw std::system_error(errno, std::system_category(), "Failed to punch hole in file: " + file_name_);
+    }
+#endif
+#ifdef MADV_REMOVE
+    // filesystems (or kernels) without fallocate punching may still free the backing store of a shared writable mapping
+    if (!punched)
+      punched = madvise(reinterpret_cast<std::byte *>(region_) + begin, end - begin, MADV_REMOVE) == 0;
+#else
+    if (!punched)
+      errno = EOPNOTSUPP;
+#endif
+    if (!punched) {
+      throw std::system_error(errno, std::system_category(), "Failed to punch hole in file: " + file_name_);
+    }
+    if (checksums_) { // no flush sees the hole, it's not written through the mapping
+      checksums_->zeroed(reinterpret_cast<const std::byte *>(region_), begin, end);
+      checksums_->save(checksums_file(file_name_));
+    }
+    return end - begin;
+  }
+
+  // fork a child writing a point-in-time image of the region to file_name, a DBMR file of the same capacity,
+  // while this process keeps mutating the region, see fork_snapshot,
+  // dirty tracking is on for the duration, so pages first written meanwhile cost a write fault and a page copy
+  DBMR<RT> &snapshot_to(const std::string &file_name) {
+    if (snapshot_in_progress()) {
+      throw std::logic_error("!?another snapshot of DBMR in progress?!");
+    }
+    wait_snapshot();
+    if (!dirty_tracker_) {
+      dirty_tracker_ = std::make_unique<dirty_tracker>(region_, region_->capacity());
+      snapshot_tracking_ = true;
+    }
+    try {
+      snapshot_ = std::make_unique<fork_snapshot>(*dirty_tracker_, file_name, [](const std::byte *first_page) {
+        return reinterpret_cast<const memory_region<RT> *>(first_page)->occupation();
+      });
+    } catch (...) {
+      if (snapshot_tracking_) {
+        dirty_tracker_.reset();
+        snapshot_tracking_ = false;
+      }
+      throw;
+    }
+    return *this;
+  }
+
+  bool snapshot_in_progress() { return snapshot_ && !snapshot_->finished(); }
+
+  // wait for the last snapshot to be written, throws if it failed
+  void wait_snapshot() {
+    if (!snapshot_)
+      return;
+    std::unique_ptr<fork_snapshot> snapshot = std::move(snapshot_);
+    std::exception_ptr failure;
+    try {
+      snapshot->wait();
+    } catch (...) {
+      failure = std::current_exception();
+    }
+    snapshot.reset();
+    if (snapshot_tracking_) {
+      dirty_tracker_.reset();
+      snapshot_tracking_ = false;
+    }
+    if (failure)
+      std::rethrow_exception(failure);
+  }
+
+  // an independent copy of the DBMR file, O(1) on CoW filesystems,
+  // writes through the mapping not yet flushed are included, as they're in the page cache already
+  bulk_io::clone_method clone_to(const std::string &file_name) const {
+    require_file("clone");
+    return bulk_io::clone_file(file_name_, file_name);
+  }
+
+  struct space_usage {
+    size_t logical_size;   // file size
+    size_t allocated_size; // disk blocks actually allocated, less than logical_size for a sparse file
+  };
+
+  space_usage storage_usage() const {
+    struct stat statbuf;
+    if (fstat(fd_, &statbuf) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to stat file: " + file_name_);
+    }
+    return space_usage{size_t(statbuf.st_size), size_t(statbuf.st_blocks) * 512};
+  }
+
   memory_region<RT> *region() { return region_; }
   const memory_region<RT> *region() const { return region_; }
 };
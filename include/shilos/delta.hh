@@ -0,0 +1,68 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace shilos {
+
+//
+// binary delta between two versions of a region image (a DBMR file), for shipping only the changed pages
+//
+// a region never moves its data, objects are bump allocated and mutated in place, so a new version differs from the
+// old one in whole blocks at the same offsets, plus an appended tail, block hashes at fixed offsets suffice, there is
+// nothing for a rolling hash to find
+//
+// the rsync like flow, the old version needn't be where the delta is computed:
+//   signature sig = region_delta::sign(old_file);          // where the old version is, small (8 bytes per block)
+//   region_delta::diff(sig, new_file, delta_file);          // where the new version is
+//   region_delta::patch(old_file, delta_file, out_file);    // where the old version is
+//
+// files are hashed through readonly mappings, in parallel, with a lane parallel hash the compiler vectorizes
+//
+class region_delta {
+public:
+  static constexpr size_t DEFAULT_BLOCK_SIZE = 4096;
+
+  struct signature {
+    size_t block_size = DEFAULT_BLOCK_SIZE;
+    size_t file_size = 0;
+    uint64_t content_hash = 0; // hash_content() of the whole file
+    std::vector<uint64_t> block_hashes;
+  };
+
+  struct stats {
+    size_t changed_blocks = 0;
+    size_t runs = 0;
+    size_t literal_bytes = 0;
+  };
+
+  static signature sign(const std::string &file_name, size_t block_size = DEFAULT_BLOCK_SIZE);
+
+  static void save_signature(const signature &sig, const std::string &file_name);
+  static signature load_signature(const std::string &file_name);
+
+  // write the delta turning the signed old version into new_file
+  static stats diff(const signature &old_sig, const std::string &new_file, const std::string &delta_file);
+
+  // write the new version to out_file from the old version and a delta, out_file may be old_file to patch in place,
+  // old_file is cloned (reflinked where possible) to a temporary file next to out_file, patched, and renamed over
+  // out_file, so out_file is left as it was if patching fails, unless verify is false, old_file is checked to be the
+  // version the delta was computed against before patching, and the result to be the new version before the rename,
+  // both by the content hashes recorded in the delta
+  static stats patch(const std::string &old_file, const std::string &delta_file, const std::string &out_file,
+                     bool verify = true);
+
+  // the block hash, processing 4 lanes of 64 bits at a time
+  static uint64_t hash_block(const std::byte *data, size_t len, uint64_t seed = 0);
+
+  // hash of a whole file's content, hashed in one pass with a seed of its own, so it's independent of block hashes
+  static uint64_t hash_content(const std::byte *data, size_t len);
+
+private:
+  static constexpr uint64_t CONTENT_SEED = 0x5348494C4F53ULL;
+};
+
+} // namespace shilos
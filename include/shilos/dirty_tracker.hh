@@ -0,0 +1,92 @@
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace shilos {
+
+//
+// dirty page tracking of a writable shared mapping, via write faults
+//
+// the tracked range is kept readonly, the first write to a page faults into a process-wide SIGSEGV/SIGBUS handler,
+// which marks the page dirty and makes it writable again, so writers pay one fault per page per flush interval
+//
+// flush() msyncs only the dirty pages, coalesced into contiguous ranges, and a background flusher can do so
+// periodically, bounding how long written data stays volatile, instead of leaving it to kernel writeback
+//
+// NOTE: syscalls writing into a tracked range (read(2) into it e.g.) fail with EFAULT instead of faulting,
+//       write through user space memory copies instead
+//
+// NOTE: the fault handler is process-wide, a SIGSEGV/SIGBUS handler installed after it replaces it, LLVM's signal
+//       handlers (installed by clang-repl inside cod e.g.) then see the write faults into tracked ranges first, and
+//       take them for crashes, start tracking after such handlers are installed, unrelated faults are chained to them
+//
+class dirty_tracker {
+public:
+  typedef std::pair<size_t, size_t> range; // [begin, end) offsets
+
+  dirty_tracker(void *base, size_t size);
+  ~dirty_tracker();
+
+  dirty_tracker(const dirty_tracker &) = delete;
+  dirty_tracker &operator=(const dirty_tracker &) = delete;
+
+  void *base() const { return base_; }
+  size_t size() const { return size_; }
+  static size_t page_size();
+
+  size_t dirty_pages() const;
+
+  // take the coalesced dirty ranges, rearming write faults for them
+  std::vector<range> take_dirty_ranges();
+
+  // msync the dirty ranges, returns the number of bytes synced, on failure the ranges not synced are dirty again
+  size_t flush();
+
+  // called by every flush, whichever thread it runs in, with the ranges just synced
+  void on_flushed(std::function<void(const std::vector<range> &)> hook);
+
+  // flush in a background thread, at most latency_budget after pages got dirty
+  void start_flusher(std::chrono::milliseconds latency_budget);
+  void stop_flusher();
+
+  // mark all pages dirty, e.g. before writing the whole range from a syscall
+  void mark_all_dirty();
+
+  // mark the pages of ranges dirty (and writable) again, e.g. taken but failed to be synced, pages failing to be made
+  // writable stay marked, and just fault once more
+  void mark_dirty(const std::vector<range> &ranges);
+
+  // until end_snapshot(), the first write to each page copies its prior content into the page of preimage at the
+  // same offset, then sets flags[page], so a forked child can still read the range as of begin_snapshot(),
+  // both should be shared mappings, to be visible to the child
+  void begin_snapshot(std::byte *preimage, std::atomic<uint8_t> *flags);
+  void end_snapshot();
+
+private:
+  std::byte *base_;
+  size_t size_;
+  size_t n_pages_;
+  std::unique_ptr<std::atomic<uint64_t>[]> bitmap_;
+  int slot_;
+
+  std::mutex flush_mutex_; // one flush at a time
+  std::function<void(const std::vector<range> &)> flushed_hook_;
+
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  bool flusher_stop_ = false;
+  std::thread flusher_;
+};
+
+} // namespace shilos
@@ -0,0 +1,107 @@
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace shilos {
+
+// replace file_name with tmp_name, syncing tmp_name before and the directory after the rename, so after a crash
+// file_name is either the old file or the new one, complete, and stays the new one once this returns
+void durable_rename(const std::string &tmp_name, const std::string &file_name);
+
+//
+// process-wide durability service with group commit
+//
+// writers mark commit points against registered targets (writable DBMRs e.g.) and get tickets, a single background
+// thread batches the commits, syncing each target once per batch however many commits it got, then publishes the
+// whole batch as durable at once
+//
+// knobs:
+//   max_delay - how long the first commit of a batch may wait for more to join it (latency)
+//   max_batch - a batch is started right away once this many commits are pending (throughput)
+//
+class durability_service {
+public:
+  typedef uint64_t ticket;
+  typedef uint64_t target_id;
+
+  static durability_service &instance();
+
+  // sync should make everything written to the target so far durable, it's called from the service thread only
+  target_id register_target(std::function<void()> sync);
+  // waits for the commits to the target to be synced, by the service thread, without delay, throws if that failed
+  void unregister_target(target_id target);
+
+  // mark a commit point, durable once wait_durable(ticket) returns
+  ticket commit(target_id target);
+
+  // throws if the ticket's target failed to sync it (reported once, failed tickets are remembered until waited for, the
+  // latest MAX_FAILED of them), or if it's older than a failure forgotten
+  void wait_durable(ticket t);
+  bool is_durable(ticket t) const;
+
+  void commit_and_wait(target_id target) { wait_durable(commit(target)); }
+
+  void set_max_delay(std::chrono::microseconds max_delay);
+  void set_max_batch(size_t max_batch);
+  std::chrono::microseconds max_delay() const;
+  size_t max_batch() const;
+
+  static constexpr size_t MAX_FAILED = size_t(1) << 16;
+
+  // stats
+  uint64_t batches_synced() const;
+  uint64_t commits_synced() const;
+
+private:
+  struct target_state {
+    std::function<void()> sync;
+    std::vector<ticket> pending; // commits not yet taken by a batch
+    bool syncing = false;
+    std::exception_ptr failure; // of the last failed sync, reset as unregistering starts
+  };
+
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;    // service thread waits for commits
+  std::condition_variable durable_cv_; // writers wait for durability
+
+  std::map<target_id, target_state> targets_;
+  target_id next_target_ = 1;
+
+  ticket next_ticket_ = 1;
+  ticket durable_ = 0;     // all tickets up to this are settled
+  size_t n_pending_ = 0;   // commits since the last batch was taken
+  size_t urgent_ = 0;      // unregistering targets, their pending commits are batched without delay
+  std::chrono::steady_clock::time_point first_pending_;
+
+  // tickets whose sync failed, until waited for, or forgotten when too many, oldest first
+  std::map<ticket, std::exception_ptr> failed_;
+  ticket forgotten_ = 0; // the latest failed ticket forgotten
+
+  std::chrono::microseconds max_delay_{1000};
+  size_t max_batch_ = 256;
+
+  uint64_t batches_synced_ = 0;
+  uint64_t commits_synced_ = 0;
+
+  std::thread thread_;
+
+  durability_service();
+  ~durability_service() = default;
+  durability_service(const durability_service &) = delete;
+  durability_service &operator=(const durability_service &) = delete;
+
+  void run();
+};
+
+} // namespace shilos
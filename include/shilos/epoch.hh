@@ -0,0 +1,337 @@
+
+#pragma once
+
+#include "./futex.hh"
+#include "./region.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace shilos {
+
+//
+// process-wide memory barriers, for asymmetric fencing: with membarrier(2) available, the frequent side of a protocol
+// (readers entering critical sections) only needs a compiler barrier, while the rare side (reclamation) issues a
+// barrier on all running threads of all processes
+//
+
+// whether heavy_fence() is a system-wide barrier, probed once
+bool asymmetric_fences();
+
+// a full barrier on every cpu when asymmetric_fences(), a local seq_cst fence otherwise
+void heavy_fence();
+
+inline void light_fence() {
+  static const bool asymmetric = asymmetric_fences();
+  if (asymmetric)
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  else
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// whether the process is gone, so its claims in a shared region can be dropped, with the start time it had when it
+// made them (0 if unknown), a new process reusing the pid is told apart
+//
+// NOTE: pids are those of the caller's pid namespace, processes sharing a region must share one
+bool process_dead(uint32_t pid, uint64_t start_time = 0);
+
+// pid of the calling process
+uint32_t current_pid();
+
+// start time of the calling process, an opaque token for process_dead(), 0 where not available
+uint64_t current_start_time();
+
+template <size_t MAX_PARTICIPANTS> class epoch_participant;
+
+//
+// epoch-based reclamation of objects in a region shared by threads and processes, so lock-free regional containers
+// can retire unlinked nodes, and have their memory reused once no reader can possibly still reference them
+//
+// the domain lives in the region (e.g. a field of the root, or region->create<epoch_domain<>>()), each reading thread
+// attaches as a participant once, claiming a slot in the domain, then a critical section costs a store of the global
+// epoch to that slot on entry and a store of zero on exit, the matching barrier is paid by the reclaimer instead
+// (see heavy_fence()), a retired object is reclaimed two epoch advances later, and the epoch only advances when all
+// participants in critical sections have observed the current one
+//
+// regions only bump-allocate, so the domain keeps reclaimed blocks on region-resident free lists by power-of-2 size
+// class, and allocates from them first, objects to be retired must be allocated through the domain, and are reclaimed
+// without running destructors, as region objects never have theirs run anyway
+//
+// allocation, retirement and reclamation serialize on a futex lock in the domain, critical sections take no lock
+//
+// NOTE: participants write to their slots, readers need a writable mapping of the region
+// NOTE: slots of dead processes are reclaimed lazily, when they are found holding back the epoch, but a process dying
+//       while holding the domain lock stalls the domain
+// NOTE: the heavy fence of an attempt to advance is a system-wide barrier (membarrier(2)), costing every cpu, so
+//       retirements attempt it at most once per retire_threshold of them, and outside the domain lock
+//
+template <size_t MAX_PARTICIPANTS = 64> class epoch_domain {
+  static_assert(MAX_PARTICIPANTS > 0);
+
+  template <size_t N> friend class epoch_participant;
+
+  struct slot {
+    alignas(64) uint64_t epoch; // 0 when not in a critical section
+    uint32_t owner_pid;         // 0 when free
+    uint64_t owner_start;       // current_start_time() of the owner, 0 if unknown
+  };
+
+  // the bookkeeping record of a retired object, itself allocated from the domain
+  struct retired {
+    uint64_t next;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  static constexpr size_t MIN_BLOCK = 16;
+  static constexpr size_t SIZE_CLASSES = 48;
+
+  alignas(64) uint64_t epoch_;
+  alignas(64) uint32_t lock_;
+  uint64_t limbo_[3]; // retired record lists, by epoch of retirement modulo 3
+  uint64_t free_[SIZE_CLASSES];
+  uint64_t pending_; // retired objects not reclaimed yet
+  uint64_t retire_threshold_;
+  uint64_t retired_since_attempt_; // retirements since the last attempt to advance they triggered
+  slot slots_[MAX_PARTICIPANTS];
+
+  template <typename I> static std::atomic_ref<I> ref(I &i) { return std::atomic_ref<I>(i); }
+
+  // Drepper's futex mutex, 0 unlocked, 1 locked, 2 locked with waiters
+  void lock() {
+    uint32_t c = 0;
+    if (ref(lock_).compare_exchange_strong(c, 1, std::memory_order_acquire))
+      return;
+    if (c != 2)
+      c = ref(lock_).exchange(2, std::memory_order_acquire);
+    while (c != 0) {
+      futex_wait(&lock_, 2);
+      c = ref(lock_).exchange(2, std::memory_order_acquire);
+    }
+  }
+
+  void unlock() {
+    if (ref(lock_).exchange(0, std::memory_order_release) == 2)
+      futex_wake(&lock_, 1);
+  }
+
+  struct lock_guard {
+    epoch_domain &d;
+    explicit lock_guard(epoch_domain &d) : d(d) { d.lock(); }
+    ~lock_guard() { d.unlock(); }
+  };
+
+  static size_t size_class(size_t size) {
+    return std::bit_width(std::bit_ceil(std::max(size, MIN_BLOCK))) - std::bit_width(MIN_BLOCK);
+  }
+
+  template <typename T, typename RT> static T *at(memory_region<RT> *region, uint64_t offset) {
+    return reinterpret_cast<T *>(reinterpret_cast<intptr_t>(region) + offset);
+  }
+
+  // with the lock held
+  template <typename RT> uint64_t allocate_locked(memory_region<RT> *region, size_t size, size_t align) {
+    const size_t cls = size_class(std::max(size, align));
+    if (cls >= SIZE_CLASSES)
+      throw std::length_error("!?allocation too large for epoch domain?!");
+    // blocks of a class may have been allocated with a weaker alignment, only take a fit head, never search
+    const uint64_t head = free_[cls];
+    if (head != 0 && head % align == 0) {
+      free_[cls] = *at<uint64_t>(region, head);
+      return head;
+    }
+    void *ptr = region->allocate(MIN_BLOCK << cls, std::max(align, alignof(uint64_t)));
+    return reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(region);
+  }
+
+  // with the lock held
+  template <typename RT> void free_locked(memory_region<RT> *region, uint64_t offset, size_t size) {
+    const size_t cls = size_class(size);
+    *at<uint64_t>(region, offset) = free_[cls];
+    free_[cls] = offset;
+  }
+
+  // with the lock held, after a heavy_fence(), returns the number of objects reclaimed
+  template <typename RT> size_t try_advance_locked(memory_region<RT> *region) {
+    const uint64_t e = ref(epoch_).load(std::memory_order_relaxed);
+    for (slot &s : slots_) {
+      uint32_t owner = ref(s.owner_pid).load(std::memory_order_acquire);
+      if (owner == 0)
+        continue;
+      const uint64_t se = ref(s.epoch).load(std::memory_order_acquire);
+      if (se == 0 || se == e)
+        continue;
+      const uint64_t start = ref(s.owner_start).load(std::memory_order_acquire);
+      if (ref(s.owner_pid).load(std::memory_order_acquire) != owner || !process_dead(owner, start))
+        return 0;
+      // the owner died in a critical section
+      ref(s.epoch).store(0, std::memory_order_relaxed);
+      ref(s.owner_start).store(0, std::memory_order_relaxed);
+      ref(s.owner_pid).compare_exchange_strong(owner, 0, std::memory_order_release);
+    }
+    const uint64_t next = e + 1;
+    ref(epoch_).store(next, std::memory_order_release);
+    // objects retired at next - 2 (== next + 1 modulo 3) are unreachable by now
+    size_t reclaimed = 0;
+    uint64_t rec = std::exchange(limbo_[(next + 1) % 3], 0);
+    while (rec != 0) {
+      const retired r = *at<retired>(region, rec);
+      free_locked(region, r.offset, r.size);
+      free_locked(region, rec, sizeof(retired));
+      rec = r.next;
+      ++reclaimed;
+    }
+    pending_ -= reclaimed;
+    return reclaimed;
+  }
+
+public:
+  // retire_threshold: pending retirements triggering an attempt to reclaim
+  explicit epoch_domain(uint64_t retire_threshold = 64)
+      : epoch_(1), lock_(0), limbo_{}, free_{}, pending_(0), retire_threshold_(retire_threshold),
+        retired_since_attempt_(0), slots_{} {}
+
+  uint64_t epoch() const { return ref(const_cast<uint64_t &>(epoch_)).load(std::memory_order_acquire); }
+
+  // retired objects not reclaimed yet
+  uint64_t pending() const { return ref(const_cast<uint64_t &>(pending_)).load(std::memory_order_relaxed); }
+
+  // allocate raw memory, reusing reclaimed blocks when possible
+  template <typename RT> void *allocate(memory_region<RT> *region, size_t size, size_t align) {
+    lock_guard g(*this);
+    return at<void>(region, allocate_locked(region, size, align));
+  }
+
+  template <typename VT, typename RT, typename... Args>
+    requires RegionSafe<VT>
+  global_ptr<VT, RT> create(memory_region<RT> *region, Args &&...args) {
+    void *ptr = allocate(region, sizeof(VT), alignof(VT));
+    new (ptr) VT(std::forward<Args>(args)...);
+    return global_ptr<VT, RT>::from_offset(region,
+                                           reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(region));
+  }
+
+  // hand an unlinked object over for reclamation, it must have been allocated by this domain with the same size
+  template <typename RT> void retire(memory_region<RT> *region, size_t offset, size_t size) {
+    bool attempt;
+    {
+      lock_guard g(*this);
+      const uint64_t rec = allocate_locked(region, sizeof(retired), alignof(retired));
+      const uint64_t e = ref(epoch_).load(std::memory_order_relaxed);
+      *at<retired>(region, rec) = retired{limbo_[e % 3], offset, size};
+      limbo_[e % 3] = rec;
+      // an attempt blocked by a participant lingering in a critical section isn't retried on every retirement
+      attempt = ++pending_ >= retire_threshold_ && ++retired_since_attempt_ >= retire_threshold_;
+      if (attempt)
+        retired_since_attempt_ = 0;
+    }
+    if (attempt)
+      reclaim(region);
+  }
+
+  template <typename VT, typename RT> void retire(const global_ptr<VT, RT> &obj) {
+    retire(obj.region(), obj.offset(), sizeof(VT));
+  }
+
+  // try to advance the epoch, returns the number of objects reclaimed
+  template <typename RT> size_t reclaim(memory_region<RT> *region) {
+    // pairs with light_fence() of participants entering critical sections, either we see their slots, or they see
+    // the nodes unlinked before retirement, not holding the lock, it's slow
+    heavy_fence();
+    lock_guard g(*this);
+    return try_advance_locked(region);
+  }
+};
+
+//
+// a thread's membership in an epoch domain, claiming a slot for its lifetime, meant to be kept thread_local,
+// critical sections are entered with pin(), and may nest
+//
+template <size_t MAX_PARTICIPANTS = 64> class epoch_participant {
+  typedef epoch_domain<MAX_PARTICIPANTS> domain_type;
+
+  domain_type *domain_;
+  typename domain_type::slot *slot_;
+  unsigned depth_;
+
+public:
+  explicit epoch_participant(domain_type &domain) : domain_(&domain), slot_(nullptr), depth_(0) {
+    const uint32_t pid = current_pid();
+    const uint64_t start = current_start_time();
+    for (int sweep = 0; sweep < 2; ++sweep) {
+      for (auto &s : domain.slots_) {
+        uint32_t expected = 0;
+        if (domain_type::ref(s.owner_pid).compare_exchange_strong(expected, pid, std::memory_order_acq_rel)) {
+          domain_type::ref(s.owner_start).store(start, std::memory_order_release);
+          slot_ = &s;
+          return;
+        }
+        // all taken at first, take over slots left by dead processes then
+        if (sweep == 1 && process_dead(expected, domain_type::ref(s.owner_start).load(std::memory_order_acquire)) &&
+            domain_type::ref(s.owner_pid).compare_exchange_strong(expected, pid, std::memory_order_acq_rel)) {
+          domain_type::ref(s.epoch).store(0, std::memory_order_release);
+          domain_type::ref(s.owner_start).store(start, std::memory_order_release);
+          slot_ = &s;
+          return;
+        }
+      }
+    }
+    throw std::length_error("!?no free participant slot in epoch domain?!");
+  }
+
+  ~epoch_participant() {
+    if (slot_) {
+      domain_type::ref(slot_->epoch).store(0, std::memory_order_release);
+      domain_type::ref(slot_->owner_start).store(0, std::memory_order_release);
+      domain_type::ref(slot_->owner_pid).store(0, std::memory_order_release);
+    }
+  }
+
+  epoch_participant(const epoch_participant &) = delete;
+  epoch_participant &operator=(const epoch_participant &) = delete;
+
+  epoch_participant(epoch_participant &&other) noexcept
+      : domain_(other.domain_), slot_(std::exchange(other.slot_, nullptr)), depth_(other.depth_) {}
+  epoch_participant &operator=(epoch_participant &&) = delete;
+
+  void enter() {
+    if (depth_++ != 0)
+      return;
+    const uint64_t e = domain_type::ref(domain_->epoch_).load(std::memory_order_relaxed);
+    domain_type::ref(slot_->epoch).store(e, std::memory_order_relaxed);
+    light_fence();
+  }
+
+  void exit() {
+    if (--depth_ != 0)
+      return;
+    domain_type::ref(slot_->epoch).store(0, std::memory_order_release);
+  }
+
+  bool pinned() const { return depth_ != 0; }
+
+  class guard {
+    epoch_participant *p_;
+
+  public:
+    explicit guard(epoch_participant &p) : p_(&p) { p.enter(); }
+    ~guard() {
+      if (p_)
+        p_->exit();
+    }
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+    guard(guard &&other) noexcept : p_(std::exchange(other.p_, nullptr)) {}
+    guard &operator=(guard &&) = delete;
+  };
+
+  // pointers read from the domain's objects stay valid for the lifetime of the returned guard
+  guard pin() { return guard(*this); }
+};
+
+} // namespace shilos
@@ -0,0 +1,17 @@
+
+#pragma once
+
+namespace shilos {
+
+//
+// passing file descriptors between processes over a connected UNIX domain socket (SCM_RIGHTS),
+// e.g. the memfd of an anonymous DBMR, so another process can map the same region with no copying
+//
+
+// send fd with a one byte payload, the fd stays open in the sender
+void send_fd(int socket, int fd);
+
+// receive a fd sent by send_fd(), returned close-on-exec, throws on EOF or a message without a fd
+int recv_fd(int socket);
+
+} // namespace shilos
@@ -0,0 +1,24 @@
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace shilos {
+
+//
+// futex waits/wakes on 32-bit words in shared mappings (regions of DBMRs, memfds), working across processes,
+// as the kernel keys them by the backing file and offset, not by address
+//
+// on platforms without futexes, waits degrade to short sleeps polling the word
+//
+
+// wait while *addr == expected, until woken or timed out (a negative timeout waits forever),
+// returns false on timeout, and may return spuriously
+bool futex_wait(const uint32_t *addr, uint32_t expected,
+                std::chrono::nanoseconds timeout = std::chrono::nanoseconds(-1));
+
+// wake up to n waiters on addr
+void futex_wake(const uint32_t *addr, int n);
+
+} // namespace shilos
@@ -0,0 +1,375 @@
+
+#pragma once
+
+#include "./region.hh"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+namespace shilos {
+
+//
+// persistent (immutable) hash array mapped trie living in a memory region, updates return a new map sharing all
+// unchanged nodes with the old one, so keeping every historical version of a map costs only the nodes on the paths
+// to changed entries, e.g. as the data under a versioned_root, or kept per revision for undo
+//
+// nodes are compact, in the CHAMP layout: a bitmap of the 32 hash fragments holding entries inline, and a bitmap of
+// those holding child nodes, with only the present entries and children stored, indexed by popcount of the bits
+// below, past the 64 hash bits, colliding keys share a flat collision node
+//
+// the map itself is a 16-byte region-safe value (root node offset and size), to be stored in records as is, keys and
+// values must be trivially copyable, as entries are copied bytewise along with the nodes holding them
+//
+// NOTE: the node offsets are bare (OPAQUE_OFFSETS), records holding a map can't be cloned to another region, nor
+//       bulk migrated, values referencing other records aren't followed
+//
+// Hash must be stateless, and stable across processes for maps shared by them, its result is mixed further, so
+// identity hashes of integers are fine
+//
+template <typename K, typename V, typename Hash = std::hash<K>>
+  requires RegionSafe<K> && RegionSafe<V> && std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>
+class region_hamt {
+  static constexpr unsigned BITS = 5;
+  static constexpr uint32_t FRAGMENT_MASK = (1u << BITS) - 1;
+  static constexpr unsigned HASH_BITS = 64;
+
+  struct entry {
+    K key;
+    V value;
+  };
+
+  // for collision nodes, datamap holds the count of entries and nodemap is 0
+  struct node {
+    uint32_t datamap;
+    uint32_t nodemap;
+  };
+
+  static constexpr size_t ENTRIES_AT = (sizeof(node) + alignof(entry) - 1) / alignof(entry) * alignof(entry);
+  static constexpr size_t NODE_ALIGN = alignof(entry) > alignof(uint64_t) ? alignof(entry) : alignof(uint64_t);
+
+  static size_t children_at(size_t n_entries) {
+    const size_t end = ENTRIES_AT + n_entries * sizeof(entry);
+    return (end + alignof(uint64_t) - 1) / alignof(uint64_t) * alignof(uint64_t);
+  }
+
+  uint64_t root_;
+  uint64_t size_;
+
+  region_hamt(uint64_t root, uint64_t size) : root_(root), size_(size) {}
+
+  static uint64_t hash_of(const K &key) {
+    // murmur3 finalizer
+    uint64_t h = static_cast<uint64_t>(Hash{}(key));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static uint32_t bit_of(uint64_t hash, unsigned shift) { return 1u << ((hash >> shift) & FRAGMENT_MASK); }
+  static unsigned index_of(uint32_t map, uint32_t bit) { return std::popcount(map & (bit - 1)); }
+
+  // a node view, valid while the region stays mapped
+  template <typename B> struct view {
+    B *base;
+    uint64_t offset;
+
+    node &hdr() const { return *reinterpret_cast<node *>(reinterpret_cast<intptr_t>(base) + offset); }
+    unsigned n_entries(bool collision) const { return collision ? hdr().datamap : std::popcount(hdr().datamap); }
+    unsigned n_children() const { return std::popcount(hdr().nodemap); }
+    entry *entries() const { return reinterpret_cast<entry *>(reinterpret_cast<intptr_t>(&hdr()) + ENTRIES_AT); }
+    uint64_t *children(bool collision) const {
+      return reinterpret_cast<uint64_t *>(reinterpret_cast<intptr_t>(&hdr()) + children_at(n_entries(collision)));
+    }
+  };
+
+  template <typename RT> static view<memory_region<RT>> at(memory_region<RT> *region, uint64_t offset) {
+    return {region, offset};
+  }
+  template <typename RT> static view<memory_region<RT>> at(const memory_region<RT> *region, uint64_t offset) {
+    return {const_cast<memory_region<RT> *>(region), offset};
+  }
+
+  // allocate a node, to be filled by the caller
+  template <typename RT>
+  static view<memory_region<RT>> alloc_node(memory_region<RT> *region, uint32_t datamap, uint32_t nodemap,
+                                            unsigned n_entries, unsigned n_children) {
+    void *ptr = region->allocate(children_at(n_entries) + n_children * sizeof(uint64_t), NODE_ALIGN);
+    *static_cast<node *>(ptr) = node{datamap, nodemap};
+    return {region, uint64_t(reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(region))};
+  }
+
+  // a node with two entries whose hashes agree below shift, or a chain down to where they differ
+  template <typename RT>
+  static uint64_t merge(memory_region<RT> *region, const entry &e1, uint64_t h1, const entry &e2, uint64_t h2,
+                        unsigned shift) {
+    if (shift >= HASH_BITS) {
+      auto n = alloc_node(region, 2, 0, 2, 0);
+      n.entries()[0] = e1;
+      n.entries()[1] = e2;
+      return n.offset;
+    }
+    const uint32_t b1 = bit_of(h1, shift), b2 = bit_of(h2, shift);
+    if (b1 == b2) {
+      const uint64_t child = merge(region, e1, h1, e2, h2, shift + BITS);
+      auto n = alloc_node(region, 0, b1, 0, 1);
+      n.children(false)[0] = child;
+      return n.offset;
+    }
+    auto n = alloc_node(region, b1 | b2, 0, 2, 0);
+    n.entries()[b1 < b2 ? 0 : 1] = e1;
+    n.entries()[b1 < b2 ? 1 : 0] = e2;
+    return n.offset;
+  }
+
+  template <typename RT>
+  static uint64_t set_in(memory_region<RT> *region, uint64_t offset, unsigned shift, uint64_t hash, const entry &e,
+                         bool &added) {
+    const auto n = at(region, offset);
+    const node h = n.hdr();
+
+    if (shift >= HASH_BITS) {
+      const unsigned count = h.datamap;
+      for (unsigned i = 0; i < count; ++i) {
+        if (n.entries()[i].key == e.key) {
+          auto c = alloc_node(region, count, 0, count, 0);
+          std::memcpy(static_cast<void *>(c.entries()), n.entries(), count * sizeof(entry));
+          c.entries()[i] = e;
+          return c.offset;
+        }
+      }
+      auto c = alloc_node(region, count + 1, 0, count + 1, 0);
+      std::memcpy(static_cast<void *>(c.entries()), n.entries(), count * sizeof(entry));
+      c.entries()[count] = e;
+      added = true;
+      return c.offset;
+    }
+
+    const uint32_t bit = bit_of(hash, shift);
+    const unsigned ne = std::popcount(h.datamap), nc = std::popcount(h.nodemap);
+
+    if (h.datamap & bit) {
+      const unsigned di = index_of(h.datamap, bit);
+      const entry &old = n.entries()[di];
+      if (old.key == e.key) {
+        auto c = alloc_node(region, h.datamap, h.nodemap, ne, nc);
+        std::memcpy(static_cast<void *>(c.entries()), n.entries(), ne * sizeof(entry));
+        std::memcpy(c.children(false), n.children(false), nc * sizeof(uint64_t));
+        c.entries()[di] = e;
+        return c.offset;
+      }
+      // push the resident entry down, along with the new one
+      const entry resident = old;
+      const uint64_t child = merge(region, resident, hash_of(resident.key), e, hash, shift + BITS);
+      added = true;
+      auto c = alloc_node(region, h.datamap & ~bit, h.nodemap | bit, ne - 1, nc + 1);
+      std::memcpy(static_cast<void *>(c.entries()), n.entries(), di * sizeof(entry));
+      std::memcpy(static_cast<void *>(c.entries() + di), n.entries() + di + 1, (ne - di - 1) * sizeof(entry));
+      const unsigned ci = index_of(h.nodemap, bit);
+      uint64_t *src = n.children(false), *dst = c.children(false);
+      std::memcpy(dst, src, ci * sizeof(uint64_t));
+      dst[ci] = child;
+      std::memcpy(dst + ci + 1, src + ci, (nc - ci) * sizeof(uint64_t));
+      return c.offset;
+    }
+
+    if (h.nodemap & bit) {
+      const unsigned ci = index_of(h.nodemap, bit);
+      const uint64_t child = set_in(region, n.children(false)[ci], shift + BITS, hash, e, added);
+      auto c = alloc_node(region, h.datamap, h.nodemap, ne, nc);
+      std::memcpy(static_cast<void *>(c.entries()), n.entries(), ne * sizeof(entry));
+      std::memcpy(c.children(false), n.children(false), nc * sizeof(uint64_t));
+      c.children(false)[ci] = child;
+      return c.offset;
+    }
+
+    const unsigned di = index_of(h.datamap, bit);
+    auto c = alloc_node(region, h.datamap | bit, h.nodemap, ne + 1, nc);
+    std::memcpy(static_cast<void *>(c.entries()), n.entries(), di * sizeof(entry));
+    c.entries()[di] = e;
+    std::memcpy(static_cast<void *>(c.entries() + di + 1), n.entries() + di, (ne - di) * sizeof(entry));
+    std::memcpy(c.children(false), n.children(false), nc * sizeof(uint64_t));
+    added = true;
+    return c.offset;
+  }
+
+  // returns the new node offset, 0 for an emptied node, the same offset if the key is absent
+  template <typename RT>
+  static uint64_t erase_in(memory_region<RT> *region, uint64_t offset, unsigned shift, uint64_t hash, const K &key,
+                           bool &removed) {
+    const auto n = at(region, offset);
+    const node h = n.hdr();
+
+    if (shift >= HASH_BITS) {
+      const unsigned count = h.datamap;
+      for (unsigned i = 0; i < count; ++i) {
+        if (n.entries()[i].key == key) {
+          removed = true;
+          if (count == 1)
+            return 0;
+          auto c = alloc_node(region, count - 1, 0, count - 1, 0);
+          std::memcpy(static_cast<void *>(c.entries()), n.entries(), i * sizeof(entry));
+          std::memcpy(static_cast<void *>(c.entries() + i), n.entries() + i + 1, (count - i - 1) * sizeof(entry));
+          return c.offset;
+        }
+      }
+      return offset;
+    }
+
+    const uint32_t bit = bit_of(hash, shift);
+    const unsigned ne = std::popcount(h.datamap), nc = std::popcount(h.nodemap);
+
+    if (h.datamap & bit) {
+      const unsigned di = index_of(h.datamap, bit);
+      if (!(n.entries()[di].key == key))
+        return offset;
+      removed = true;
+      if (ne == 1 && nc == 0)
+        return 0;
+      auto c = alloc_node(region, h.datamap & ~bit, h.nodemap, ne - 1, nc);
+      std::memcpy(static_cast<void *>(c.entries()), n.entries(), di * sizeof(entry));
+      std::memcpy(static_cast<void *>(c.entries() + di), n.entries() + di + 1, (ne - di - 1) * sizeof(entry));
+      std::memcpy(c.children(false), n.children(false), nc * sizeof(uint64_t));
+      return c.offset;
+    }
+
+    if (h.nodemap & bit) {
+      const unsigned ci = index_of(h.nodemap, bit);
+      const uint64_t child = erase_in(region, n.children(false)[ci], shift + BITS, hash, key, removed);
+      if (!removed)
+        return offset;
+      const auto cn = at(region, child);
+      const bool child_collision = shift + BITS >= HASH_BITS;
+      if (child == 0 || (cn.n_entries(child_collision) == 1 && (child_collision || cn.n_children() == 0))) {
+        // keep the trie canonical, a child left with a single entry is inlined here, and a node left with that only
+        // is re-made at this level, for the parent to inline in turn
+        if (ne == 0 && nc == 1) {
+          if (child == 0)
+            return 0;
+          auto c = alloc_node(region, bit, 0, 1, 0);
+          c.entries()[0] = cn.entries()[0];
+          return c.offset;
+        }
+        const unsigned ni = child == 0 ? ne : ne + 1;
+        const uint32_t datamap = child == 0 ? h.datamap : h.datamap | bit;
+        auto c = alloc_node(region, datamap, h.nodemap & ~bit, ni, nc - 1);
+        if (child == 0) {
+          std::memcpy(static_cast<void *>(c.entries()), n.entries(), ne * sizeof(entry));
+        } else {
+          const unsigned di = index_of(h.datamap, bit);
+          std::memcpy(static_cast<void *>(c.entries()), n.entries(), di * sizeof(entry));
+          c.entries()[di] = cn.entries()[0];
+          std::memcpy(static_cast<void *>(c.entries() + di + 1), n.entries() + di, (ne - di) * sizeof(entry));
+        }
+        uint64_t *src = n.children(false), *dst = c.children(false);
+        std::memcpy(dst, src, ci * sizeof(uint64_t));
+        std::memcpy(dst + ci, src + ci + 1, (nc - ci - 1) * sizeof(uint64_t));
+        return c.offset;
+      }
+      auto c = alloc_node(region, h.datamap, h.nodemap, ne, nc);
+      std::memcpy(static_cast<void *>(c.entries()), n.entries(), ne * sizeof(entry));
+      std::memcpy(c.children(false), n.children(false), nc * sizeof(uint64_t));
+      c.children(false)[ci] = child;
+      return c.offset;
+    }
+
+    return offset;
+  }
+
+  template <typename RT, typename F>
+  static void visit(const memory_region<RT> *region, uint64_t offset, unsigned shift, F &f) {
+    const auto n = at(region, offset);
+    const bool collision = shift >= HASH_BITS;
+    const unsigned ne = n.n_entries(collision);
+    for (unsigned i = 0; i < ne; ++i)
+      f(static_cast<const K &>(n.entries()[i].key), static_cast<const V &>(n.entries()[i].value));
+    if (collision)
+      return;
+    const unsigned nc = n.n_children();
+    for (unsigned i = 0; i < nc; ++i)
+      visit(region, n.children(false)[i], shift + BITS, f);
+  }
+
+public:
+  static constexpr bool OPAQUE_OFFSETS = true;
+
+  // the empty map
+  region_hamt() : root_(0), size_(0) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // versions of a map are the same iff they share the root node
+  bool same_as(const region_hamt &other) const { return root_ == other.root_; }
+
+  template <typename RT> const V *find(const memory_region<RT> *region, const K &key) const {
+    if (root_ == 0)
+      return nullptr;
+    const uint64_t hash = hash_of(key);
+    uint64_t offset = root_;
+    for (unsigned shift = 0;; shift += BITS) {
+      const auto n = at(region, offset);
+      const node h = n.hdr();
+      if (shift >= HASH_BITS) {
+        for (unsigned i = 0; i < h.datamap; ++i)
+          if (n.entries()[i].key == key)
+            return &n.entries()[i].value;
+        return nullptr;
+      }
+      const uint32_t bit = bit_of(hash, shift);
+      if (h.datamap & bit) {
+        const entry &e = n.entries()[index_of(h.datamap, bit)];
+        return e.key == key ? &e.value : nullptr;
+      }
+      if (!(h.nodemap & bit))
+        return nullptr;
+      offset = n.children(false)[index_of(h.nodemap, bit)];
+    }
+  }
+
+  template <typename RT> bool contains(const memory_region<RT> *region, const K &key) const {
+    return find(region, key) != nullptr;
+  }
+
+  // a new version with key mapped to value, this one is left intact
+  template <typename RT> region_hamt set(memory_region<RT> *region, const K &key, const V &value) const {
+    entry e;
+    std::memset(static_cast<void *>(&e), 0, sizeof(e)); // no stray padding bytes into the region
+    e.key = key;
+    e.value = value;
+    const uint64_t hash = hash_of(key);
+    if (root_ == 0) {
+      auto n = alloc_node(region, bit_of(hash, 0), 0, 1, 0);
+      n.entries()[0] = e;
+      return region_hamt(n.offset, 1);
+    }
+    bool added = false;
+    const uint64_t root = set_in(region, root_, 0, hash, e, added);
+    return region_hamt(root, size_ + (added ? 1 : 0));
+  }
+
+  // a new version without key, or this very version if key is absent
+  template <typename RT> region_hamt erase(memory_region<RT> *region, const K &key) const {
+    if (root_ == 0)
+      return *this;
+    bool removed = false;
+    const uint64_t root = erase_in(region, root_, 0, hash_of(key), key, removed);
+    if (!removed)
+      return *this;
+    return region_hamt(root, size_ - 1);
+  }
+
+  // call f(const K &, const V &) for each entry, in hash order
+  template <typename RT, typename F> void for_each(const memory_region<RT> *region, F &&f) const {
+    if (root_ != 0)
+      visit(region, root_, 0, f);
+  }
+};
+
+} // namespace shilos
@@ -0,0 +1,327 @@
+
+#pragma once
+
+#include "./poly.hh"
+#include "./region.hh"
+
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace shilos {
+
+//
+// lazy schema migration of records whose layout evolves, so files written with older layouts stay readable, and get
+// upgraded object by object as they are accessed, instead of all files being rewritten offline at once
+//
+// an evolving record starts with a schema_header, stamped with its SCHEMA_VERSION, and lists its earlier layouts,
+// oldest first, in SCHEMA_HISTORY, each newer layout (the current one included) provides an upgrade from the one
+// before it:
+//
+//   struct TaskV1 {
+//     static constexpr uint32_t SCHEMA_VERSION = 1;
+//     schema_header schema{SCHEMA_VERSION};
+//     uint32_t priority;
+//   };
+//   struct Task {
+//     static constexpr uint32_t SCHEMA_VERSION = 2;
+//     using SCHEMA_HISTORY = schema_history<TaskV1>;
+//     schema_header schema{SCHEMA_VERSION};
+//     uint64_t priority;
+//     regional_ptr<Note> note;
+//     static constexpr auto REGIONAL_PTRS = std::make_tuple(&Task::note);
+//
+//     template <typename RT> static void upgrade(const TaskV1 &old, Task &out, upgrade_context<RT> &) {
+//       out.priority = old.priority;
+//     }
+//   };
+//
+// layouts are only ever appended to a history, old ones are kept as they were written, and the TYPE_UUID of a root
+// type stays the same across its layouts, so older files still open as regions of it
+//
+// a record is upgraded on first access through lazy_migration, into a new object of the current layout (the layouts
+// differ in size, so never in place), the old object is left forwarding to the new one, and the field referencing it
+// is repointed when accessed via lazy_migration::field(), bulk_migrator does the same for all records reachable from
+// the root (following REGIONAL_PTRS), incrementally, or in a background thread
+//
+// NOTE: migrating writes to the region, it needs a writable mapping, and is a mutation like any other, to be
+//       serialized with other writers
+//
+
+// header of evolving records, as their first member
+struct schema_header {
+  uint32_t version;  // layout version the record was written with
+  uint32_t reserved; // 0
+  uint64_t forward;  // offset of the record upgraded from this one, 0 if not upgraded yet
+
+  constexpr explicit schema_header(uint32_t version) : version(version), reserved(0), forward(0) {}
+};
+
+// earlier layouts of an evolving record, oldest first
+template <typename... Ls> struct schema_history {
+  typedef std::tuple<Ls...> layouts;
+};
+
+template <typename T>
+concept Evolving = requires {
+  { T::SCHEMA_VERSION } -> std::convertible_to<uint32_t>;
+  typename T::SCHEMA_HISTORY::layouts;
+} && std::is_same_v<decltype(T::schema), schema_header> && std::is_standard_layout_v<T>;
+
+template <typename RT> class upgrade_context;
+template <typename RT> class bulk_migrator;
+
+class lazy_migration {
+  template <typename RT> friend class upgrade_context;
+  template <typename RT> friend class bulk_migrator;
+
+  template <typename RT> static std::byte *at(memory_region<RT> *region, uint64_t offset) {
+    return reinterpret_cast<std::byte *>(reinterpret_cast<intptr_t>(region) + offset);
+  }
+
+  // the layouts of T, oldest first, ending with T itself
+  template <typename T>
+  using chain_of = decltype(std::tuple_cat(std::declval<typename T::SCHEMA_HISTORY::layouts>(), std::tuple<T>()));
+
+  template <typename T, size_t I> using layout = std::tuple_element_t<I, chain_of<T>>;
+
+  template <typename T> static constexpr size_t chain_length = std::tuple_size_v<chain_of<T>>;
+
+  // upgrade the layout I object at src, through the later layouts, into a T at dst
+  template <typename T, size_t I, typename RT>
+  static void upgrade_chain(const std::byte *src, std::byte *dst, upgrade_context<RT> &ctx) {
+    using From = layout<T, I>;
+    using To = layout<T, I + 1>;
+    alignas(To) std::byte tmp[sizeof(To)];
+    To *to = new (tmp) To();
+    To::upgrade(*reinterpret_cast<const From *>(src), *to, ctx);
+    if constexpr (I + 2 == chain_length<T>) {
+      std::memcpy(dst, tmp, sizeof(To));
+    } else {
+      upgrade_chain<T, I + 1>(tmp, dst, ctx);
+    }
+  }
+
+  template <typename T, typename RT, size_t... Is>
+  static bool upgrade_from(uint32_t version, const std::byte *src, std::byte *dst, upgrade_context<RT> &ctx,
+                           std::index_sequence<Is...>) {
+    return ((layout<T, Is>::SCHEMA_VERSION == version ? (upgrade_chain<T, Is>(src, dst, ctx), true) : false) || ...);
+  }
+
+  // the header is read at the record start, whatever its layout
+  template <typename T> static constexpr bool schema_first() { return offsetof(T, schema) == 0; }
+
+  // offset of the current layout of the T record at offset, upgrading it if need be, counted in upgraded
+  template <typename T, typename RT>
+  static uint64_t migrate(memory_region<RT> *region, uint64_t offset, size_t *upgraded = nullptr) {
+    static_assert(schema_first<T>(), "!?the schema header must be the first member of an evolving record?!");
+    if (offset == 0)
+      return 0;
+    auto *header = reinterpret_cast<schema_header *>(at(region, offset));
+    if (header->version == T::SCHEMA_VERSION)
+      return offset;
+    if (header->forward != 0) {
+      // upgraded by an earlier build, to a layout that may be outdated by now in turn, follow (and upgrade) the chain,
+      // then shortcut it
+      const uint64_t moved = migrate<T>(region, header->forward, upgraded);
+      if (moved != header->forward)
+        header->forward = moved;
+      return moved;
+    }
+    if (header->version > T::SCHEMA_VERSION) {
+      throw std::runtime_error("Schema too new: version " + std::to_string(header->version) + " vs current " +
+                               std::to_string(T::SCHEMA_VERSION));
+    }
+    upgrade_context<RT> ctx(region);
+    alignas(T) std::byte record[sizeof(T)];
+    if (!upgrade_from<T>(header->version, at(region, offset), record, ctx,
+                         std::make_index_sequence<chain_length<T> - 1>())) {
+      throw std::runtime_error("Unknown schema version: " + std::to_string(header->version));
+    }
+    void *ptr = region->allocate(sizeof(T), alignof(T));
+    std::memcpy(ptr, record, sizeof(T));
+    const uint64_t moved = reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(region);
+    // re-derive, the header is still where it was, regions never move while mapped
+    reinterpret_cast<schema_header *>(at(region, offset))->forward = moved;
+    if (upgraded)
+      ++*upgraded;
+    return moved;
+  }
+
+public:
+  // whether the record is of an older layout (upgraded or not), needs no write access
+  template <typename T, typename RT>
+    requires Evolving<T>
+  static bool outdated(const global_ptr<T, RT> &ptr) {
+    static_assert(schema_first<T>(), "!?the schema header must be the first member of an evolving record?!");
+    return ptr && reinterpret_cast<const schema_header *>(ptr.get())->version != T::SCHEMA_VERSION;
+  }
+
+  // the record in its current layout, upgraded on first access
+  template <typename T, typename RT>
+    requires Evolving<T>
+  static global_ptr<T, RT> current(const global_ptr<T, RT> &ptr) {
+    return global_ptr<T, RT>::from_offset(ptr.region(), migrate<T>(ptr.region(), ptr.offset()));
+  }
+
+  // the record referenced by a field, in its current layout, with the field repointed to it
+  template <typename O, typename F, typename RT>
+    requires Evolving<F>
+  static global_ptr<F, RT> field(global_ptr<O, RT> owner, regional_ptr<F> O::*field) {
+    const uint64_t moved = migrate<F>(owner.region(), owner.get(field).offset());
+    return owner.set(field, global_ptr<F, RT>::from_offset(owner.region(), moved));
+  }
+
+  // the root in its current layout, with the region repointed to it
+  template <typename RT>
+    requires Evolving<RT>
+  static global_ptr<RT, RT> root(memory_region<RT> *region) {
+    region->set_root(global_ptr<RT, RT>::from_offset(region, migrate<RT>(region, region->root().offset())));
+    return region->root();
+  }
+};
+
+// what upgrade functions get besides the old and new records
+template <typename RT> class upgrade_context {
+  friend class lazy_migration;
+
+  memory_region<RT> *region_;
+
+  explicit upgrade_context(memory_region<RT> *region) : region_(region) {}
+
+public:
+  // to allocate objects the new layout references
+  memory_region<RT> *region() const { return region_; }
+
+  // carry a reference over from the old record to the new one
+  template <typename F> void carry(const regional_ptr<F> &from, regional_ptr<F> &to) const {
+    global_ptr<F, RT>::from_offset(region_, from.offset()).assign_to(to, region_);
+  }
+
+  // set a reference of the new record
+  template <typename F> void set(regional_ptr<F> &to, const global_ptr<F, RT> &target) const {
+    target.assign_to(to, region_);
+  }
+};
+
+//
+// migrates all records reachable from the root (following REGIONAL_PTRS, poly records as their concrete types) to
+// their current layouts, repointing the references to them, a batch at a time via step(), or in a background thread
+// taking the writers' lock per batch
+//
+template <typename RT> class bulk_migrator {
+  typedef void (*visit_fn)(bulk_migrator &, uint64_t);
+  // a record by offset and type, a record shares its offset with its first member, which may be referenced too
+  typedef std::pair<uint64_t, visit_fn> record_ref;
+  struct record_ref_hash {
+    size_t operator()(const record_ref &ref) const {
+      return std::hash<uint64_t>()(ref.first) * 31 + std::hash<visit_fn>()(ref.second);
+    }
+  };
+
+  memory_region<RT> *region_;
+  std::vector<record_ref> pending_;
+  std::unordered_set<record_ref, record_ref_hash> visited_;
+  size_t migrated_ = 0;
+  std::atomic<bool> stop_{false};
+  std::thread worker_;
+
+  template <typename T> static void visit(bulk_migrator &m, uint64_t offset) {
+    static_assert(!holds_opaque_offsets<T>(), "!?records holding bare offsets (OPAQUE_OFFSETS) can not be walked?!");
+    std::byte *obj = lazy_migration::at(m.region_, offset);
+    if constexpr (PolyBase<T>) { // walk the concrete record type instead, the base has no pointers of its own
+      T::POLY_FAMILY::visit_type(T::POLY_FAMILY::tag_of(*reinterpret_cast<const poly_object *>(obj)),
+                                 [&](auto type) { visit<typename decltype(type)::type>(m, offset); });
+    } else {
+      const auto &offsets = regional_ptr_map<T>::offsets;
+      [&]<size_t... Is>(std::index_sequence<Is...>) {
+        (m.follow<typename regional_ptr_map<T>::template target_type<Is>>(
+             *reinterpret_cast<size_t *>(obj + offsets[Is])),
+         ...);
+      }(std::make_index_sequence<regional_ptr_map<T>::count>());
+    }
+  }
+
+  template <typename F> void follow(size_t &field) {
+    if (field == 0)
+      return;
+    if constexpr (Evolving<F>) {
+      field = lazy_migration::migrate<F>(region_, field, &migrated_);
+    }
+    if (visited_.insert(record_ref(field, &visit<F>)).second)
+      pending_.emplace_back(field, &visit<F>);
+  }
+
+public:
+  explicit bulk_migrator(memory_region<RT> *region) : region_(region) {
+    size_t root = region->root().offset();
+    if constexpr (Evolving<RT>) {
+      const uint64_t moved = lazy_migration::migrate<RT>(region, root, &migrated_);
+      if (moved != root)
+        region->set_root(global_ptr<RT, RT>::from_offset(region, moved));
+      root = moved;
+    }
+    visited_.insert(record_ref(root, &visit<RT>));
+    pending_.emplace_back(root, &visit<RT>);
+  }
+
+  ~bulk_migrator() { stop(); }
+
+  bulk_migrator(const bulk_migrator &) = delete;
+  bulk_migrator &operator=(const bulk_migrator &) = delete;
+
+  // visit up to n records, returns whether there are more to visit
+  bool step(size_t n) {
+    for (; n > 0 && !pending_.empty(); --n) {
+      const auto [offset, fn] = pending_.back();
+      pending_.pop_back();
+      fn(*this, offset);
+    }
+    return !pending_.empty();
+  }
+
+  bool done() const { return pending_.empty(); }
+
+  // records upgraded so far, by this migrator
+  size_t migrated() const { return migrated_; }
+
+  // migrate in a background thread, holding writer_lock per batch of records
+  void start(std::mutex &writer_lock, size_t batch = 4096) {
+    if (worker_.joinable()) {
+      throw std::logic_error("!?bulk migrator started twice?!");
+    }
+    worker_ = std::thread([this, &writer_lock, batch] {
+      bool more = true;
+      while (more && !stop_.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(writer_lock);
+        more = step(batch);
+      }
+    });
+  }
+
+  // wait for the background migration to finish (or stop it early), it can be resumed with start() or step()
+  void wait() {
+    if (worker_.joinable())
+      worker_.join();
+  }
+
+  void stop() {
+    stop_.store(true, std::memory_order_relaxed);
+    wait();
+    stop_.store(false, std::memory_order_relaxed);
+  }
+};
+
+} // namespace shilos
@@ -0,0 +1,138 @@
+
+#pragma once
+
+#include "./region.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+
+namespace shilos {
+
+// an immutable version of the data under a versioned_root, as pinned by a reader
+template <typename VT, typename RT> class region_snapshot {
+  uint64_t version_;
+  global_ptr<VT, RT> root_;
+
+public:
+  region_snapshot(uint64_t version, const global_ptr<VT, RT> &root) : version_(version), root_(root) {}
+
+  uint64_t version() const { return version_; }
+
+  // navigate from here, the objects reachable are never overwritten by writers (copy-on-write)
+  const global_ptr<VT, RT> &root() const { return root_; }
+
+  const VT &operator*() const { return *root_; }
+  const VT *operator->() const { return root_.get(); }
+  explicit operator bool() const noexcept { return bool(root_); }
+};
+
+//
+// multi-version root pointer, for readers to see immutable snapshots while a writer publishes new versions
+//
+// the bump allocator never overwrites allocated data, so a writer updating copy-on-write (copying the objects on the
+// path to what it modifies, and linking the copies to the untouched rest) leaves every earlier version intact, the
+// versioned root tracks the root object of each version, readers pin the latest (or a recent) version, and keep
+// reading it as long as they like, without blocking or being blocked by edits, and without any per-reader state in
+// the region, so they may map it read-only
+//
+// the last HISTORY versions stay addressable by number, e.g. to compare a snapshot with its predecessor, older ones
+// remain valid for readers who pinned them, as long as nothing reclaims their objects
+//
+// publishing is optimistic, against the version a new root was derived from, a publication since makes it fail,
+// but allocation from a region is not thread-safe anyway, so concurrent writers must serialize their updates, a writer
+// dying halfway through a publication leaves the latest version as it was, for the next one to publish after
+//
+// NOTE: the root offsets in history are bare (OPAQUE_OFFSETS), records holding a versioned root can't be cloned to
+//       another region, nor bulk migrated
+//
+template <typename VT, size_t HISTORY = 64> class versioned_root {
+  static_assert(HISTORY >= 2 && (HISTORY & (HISTORY - 1)) == 0, "history size must be a power of 2");
+
+  struct entry {
+    uint64_t version; // 0 while being (re)written
+    uint64_t offset;
+  };
+
+  alignas(64) uint64_t current_; // the latest published version
+  alignas(64) entry history_[HISTORY];
+
+  template <typename I> static std::atomic_ref<I> ref(I &i) { return std::atomic_ref<I>(i); }
+  template <typename I> static std::atomic_ref<I> ref(const I &i) { return std::atomic_ref<I>(const_cast<I &>(i)); }
+
+  // the root offset of a version still in history, seqlock validated
+  std::optional<uint64_t> offset_of(uint64_t version) const {
+    const entry &e = history_[version & (HISTORY - 1)];
+    const uint64_t before = ref(e.version).load(std::memory_order_acquire);
+    const uint64_t offset = ref(e.offset).load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t after = ref(e.version).load(std::memory_order_relaxed);
+    if (before != version || after != version)
+      return std::nullopt;
+    return offset;
+  }
+
+public:
+  // version 1 has no root (a null pointer)
+  static constexpr bool OPAQUE_OFFSETS = true;
+
+  versioned_root() : current_(1), history_{} { history_[1] = entry{1, 0}; }
+
+  static constexpr size_t history_size() { return HISTORY; }
+
+  uint64_t version() const { return ref(current_).load(std::memory_order_acquire); }
+
+  // pin the latest version
+  template <typename RT> region_snapshot<VT, RT> pin(memory_region<RT> *region) const {
+    for (;;) {
+      const uint64_t v = version();
+      if (auto offset = offset_of(v))
+        return region_snapshot<VT, RT>(v, global_ptr<VT, RT>::from_offset(region, *offset));
+      // lapped by HISTORY publications meanwhile, retry with the latest
+    }
+  }
+
+  // pin a specific version, if it is still in history
+  template <typename RT> std::optional<region_snapshot<VT, RT>> pin(memory_region<RT> *region, uint64_t version) const {
+    if (version == 0 || version > this->version())
+      return std::nullopt;
+    if (auto offset = offset_of(version))
+      return region_snapshot<VT, RT>(version, global_ptr<VT, RT>::from_offset(region, *offset));
+    return std::nullopt;
+  }
+
+  // publish root as the version after base, returns the new version, or 0 if base is no longer the latest
+  template <typename RT> uint64_t publish(const global_ptr<VT, RT> &root, uint64_t base) {
+    if (ref(current_).load(std::memory_order_relaxed) != base)
+      return 0;
+    // the entry of a version not yet published, readers don't look at it before current_ says so
+    const uint64_t v = base + 1;
+    entry &e = history_[v & (HISTORY - 1)];
+    ref(e.version).store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    ref(e.offset).store(root.offset(), std::memory_order_relaxed);
+    ref(e.version).store(v, std::memory_order_release);
+    uint64_t expected = base;
+    if (!ref(current_).compare_exchange_strong(expected, v, std::memory_order_acq_rel))
+      return 0; // unserialized writers
+    return v;
+  }
+
+  // copy-on-write update: copy the latest root object, let mutate(global_ptr<VT, RT>) modify the copy (duplicating
+  // deeper objects it modifies in turn), and publish it, returns the new version
+  template <typename RT, typename F> uint64_t update(memory_region<RT> *region, F &&mutate) {
+    const auto base = pin(region);
+    if (!base)
+      throw std::logic_error("!?copy-on-write update of a null root?!");
+    auto copy = region->duplicate(base.root());
+    mutate(copy);
+    const uint64_t v = publish(copy, base.version());
+    if (v == 0)
+      throw std::logic_error("!?concurrent publication to a versioned root?!");
+    return v;
+  }
+};
+
+} // namespace shilos
@@ -0,0 +1,229 @@
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+#include "./region.hh"
+
+namespace shilos {
+
+//
+// region-safe polymorphism
+//
+// virtual functions can not live in a region, as vtable ptrs differ across processes (even across runs of the same
+// program), so records of a polymorphic family derive from poly_object instead, which stores a small type tag, and
+// calls go through compile-time generated dispatch tables indexed by that tag, costing a single indirect call
+//
+// a family is declared by its base record, listing all concrete record types of it:
+//
+//   struct Circle;
+//   struct Square;
+//   struct Shape : poly_object {
+//     using POLY_FAMILY = poly_family<Circle, Square>;
+//   };
+//   struct Circle : Shape {
+//     static constexpr UUID TYPE_UUID = UUID("...");
+//     double radius;
+//     double area() const;
+//   };
+//   ...
+//   global_ptr<Circle, RT> c = Shape::POLY_FAMILY::create<Circle>(*mr, 1.0);
+//   rec.set(&Rec::shape, c); // a regional_ptr<Shape> field
+//   double a = poly_visit(rec.get(&Rec::shape), [](const auto &shape) { return shape.area(); });
+//
+// tags are 1-based positions in the POLY_FAMILY list, and tag 0 marks an object not created via its family, next to
+// the tag, each object stores a 32-bit stamp folded from the TYPE_UUID of its type, checked on every dispatch, so an
+// object whose tag no longer matches its type (the family list got reordered since it was stored) is found its type
+// by stamp instead (slower), and one of a type removed from the family is rejected as unknown
+//
+// the concrete record types must have their poly_object base at offset 0 (single inheritance), as ptr upcasts and
+// dispatch rely on it
+//
+class poly_object {
+  template <typename... Ts> friend class poly_family;
+
+public:
+  typedef uint16_t tag_type;
+
+  typedef uint32_t stamp_type;
+
+private:
+  tag_type poly_tag_ = 0;
+  uint16_t reserved_ = 0;
+  stamp_type poly_stamp_ = 0;
+
+public:
+  tag_type poly_tag() const { return poly_tag_; }
+  stamp_type poly_stamp() const { return poly_stamp_; }
+
+  static constexpr stamp_type stamp_of(const UUID &type_uuid) {
+    stamp_type stamp = 0;
+    for (size_t i = 0; i < 16; ++i)
+      stamp ^= stamp_type(type_uuid.byte(i)) << (8 * (i % 4));
+    return stamp;
+  }
+};
+
+template <typename... Ts> class poly_family {
+public:
+  typedef poly_object::tag_type tag_type;
+
+  static constexpr size_t size = sizeof...(Ts);
+  static_assert(size < std::numeric_limits<tag_type>::max(), "!?too many types in a poly family?!");
+  static_assert((std::is_base_of_v<poly_object, Ts> && ...), "!?poly family members must derive from poly_object?!");
+
+  static constexpr UUID TYPE_UUIDS[size] = {Ts::TYPE_UUID...};
+  static constexpr poly_object::stamp_type TYPE_STAMPS[size] = {poly_object::stamp_of(Ts::TYPE_UUID)...};
+
+  template <typename T> static constexpr bool contains = (std::is_same_v<T, Ts> || ...);
+
+  template <typename T> static consteval tag_type tag_of() {
+    tag_type tag = 0, i = 0;
+    ((++i, std::is_same_v<T, Ts> ? tag = i : 0), ...);
+    return tag;
+  }
+
+  // 0 if not a member of this family
+  static tag_type tag_of(const UUID &type_uuid) {
+    for (size_t i = 0; i < size; ++i) {
+      if (TYPE_UUIDS[i] == type_uuid)
+        return static_cast<tag_type>(i + 1);
+    }
+    return 0;
+  }
+
+  // tag of the concrete record type of obj, checked against its stamp, 0 if untagged or of a type not in this family
+  static tag_type tag_of(const poly_object &obj) {
+    const tag_type tag = obj.poly_tag_;
+    if (tag != 0 && tag <= size && TYPE_STAMPS[tag - 1] == obj.poly_stamp_)
+      return tag;
+    if (tag == 0)
+      return 0;
+    for (size_t i = 0; i < size; ++i) { // the family list got reordered since obj was stored
+      if (TYPE_STAMPS[i] == obj.poly_stamp_)
+        return static_cast<tag_type>(i + 1);
+    }
+    return 0;
+  }
+
+  static const UUID &type_uuid(tag_type tag) {
+    if (tag == 0 || tag > size)
+      throw std::out_of_range("!?invalid poly tag?!");
+    return TYPE_UUIDS[tag - 1];
+  }
+
+private:
+  static consteval bool distinct_uuids() {
+    for (size_t i = 0; i < size; ++i)
+      for (size_t j = i + 1; j < size; ++j)
+        if (TYPE_UUIDS[i] == TYPE_UUIDS[j])
+          return false;
+    return true;
+  }
+  static_assert(distinct_uuids(), "!?duplicate TYPE_UUID in a poly family?!");
+
+  static consteval bool distinct_stamps() {
+    for (size_t i = 0; i < size; ++i)
+      for (size_t j = i + 1; j < size; ++j)
+        if (TYPE_STAMPS[i] == TYPE_STAMPS[j])
+          return false;
+    return true;
+  }
+  static_assert(distinct_stamps(), "!?TYPE_UUIDs of a poly family collide in their stamps?!");
+  static_assert((base_at_offset_zero<poly_object, Ts>() && ...),
+                "!?poly family members must have their poly_object base at offset 0?!");
+
+  using first_type = std::tuple_element_t<0, std::tuple<Ts...>>;
+
+  template <typename P, typename T> using like_const = std::conditional_t<std::is_const_v<P>, const T, T>;
+
+  template <typename R, typename P, typename F> static R untagged(P *, F &) {
+    throw std::logic_error("!?untagged or unknown poly object?!");
+  }
+
+  template <typename T, typename R, typename P, typename F> static R invoke(P *obj, F &f) {
+    return f(*static_cast<like_const<P, T> *>(obj));
+  }
+
+  template <typename T, typename F> static void invoke_type(F &f) { f(std::type_identity<T>()); }
+
+  template <typename F> static void unknown_type(F &) { throw std::logic_error("!?untagged or unknown poly type?!"); }
+
+public:
+  template <typename T, typename RT, typename... Args>
+    requires contains<T>
+  static global_ptr<T, RT> create(memory_region<RT> &mr, Args &&...args) {
+    global_ptr<T, RT> ptr = mr.template create<T>(std::forward<Args>(args)...);
+    poly_object *obj = static_cast<poly_object *>(ptr.get());
+    obj->poly_tag_ = tag_of<T>();
+    obj->poly_stamp_ = TYPE_STAMPS[tag_of<T>() - 1];
+    return ptr;
+  }
+
+  // invoke f with the concrete record, by a single indirect call through the family's dispatch table
+  template <typename B, typename F>
+    requires std::is_base_of_v<poly_object, std::remove_cv_t<B>>
+  static decltype(auto) visit(B *obj, F &&f) {
+    using P = like_const<B, poly_object>;
+    using R = std::invoke_result_t<F &, like_const<B, first_type> &>;
+    static constexpr R (*table[size + 1])(P *, F &) = {&untagged<R, P, F>, &invoke<Ts, R, P, F>...};
+    if (obj == nullptr) {
+      throw std::logic_error("!?poly visit of a null ptr?!");
+    }
+    return table[tag_of(*obj)](obj, f);
+  }
+
+  template <typename VT, typename RT, typename F> static decltype(auto) visit(global_ptr<VT, RT> &ptr, F &&f) {
+    return visit(ptr.get(), std::forward<F>(f));
+  }
+
+  template <typename VT, typename RT, typename F> static decltype(auto) visit(const global_ptr<VT, RT> &ptr, F &&f) {
+    return visit(ptr.get(), std::forward<F>(f));
+  }
+
+  // invoke f with std::type_identity of the concrete record type for a tag
+  template <typename F> static void visit_type(tag_type tag, F &&f) {
+    static constexpr void (*table[size + 1])(F &) = {&unknown_type<F>, &invoke_type<Ts, F>...};
+    if (tag > size)
+      tag = 0;
+    table[tag](f);
+  }
+
+  // null if the pointee is not a T
+  template <typename T, typename VT, typename RT>
+    requires contains<T>
+  static global_ptr<T, RT> cast(const global_ptr<VT, RT> &ptr) {
+    if (!ptr || tag_of(*ptr.get()) != tag_of<T>())
+      return global_ptr<T, RT>::from_offset(ptr.region(), 0);
+    return global_ptr<T, RT>::from_offset(ptr.region(), ptr.offset());
+  }
+};
+
+// a base record of a poly family, with its concrete record types derived from it
+template <typename T>
+concept PolyBase = requires { typename T::POLY_FAMILY; } && !T::POLY_FAMILY::template contains<T>;
+
+template <typename VT, typename RT, typename F>
+  requires PolyBase<VT>
+decltype(auto) poly_visit(const global_ptr<VT, RT> &ptr, F &&f) {
+  return VT::POLY_FAMILY::visit(ptr, std::forward<F>(f));
+}
+
+template <typename VT, typename RT, typename F>
+  requires PolyBase<VT>
+decltype(auto) poly_visit(global_ptr<VT, RT> &ptr, F &&f) {
+  return VT::POLY_FAMILY::visit(ptr, std::forward<F>(f));
+}
+
+template <typename T, typename VT, typename RT>
+  requires PolyBase<VT>
+global_ptr<T, RT> poly_cast(const global_ptr<VT, RT> &ptr) {
+  return VT::POLY_FAMILY::template cast<T>(ptr);
+}
+
+} // namespace shilos
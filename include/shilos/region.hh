@@ -1,13 +1,17 @@
 
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <concepts>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <new>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 
 #include "./uuid.hh"
@@ -18,6 +22,7 @@ using std::intptr_t;
 using std::size_t;
 
 template <typename VT, typename RT> class global_ptr;
+class poly_object;
 
 //
 // region-internal pointer fields should be declared as this type,
@@ -27,7 +32,8 @@ template <typename VT, typename RT> class global_ptr;
 // via a global_ptr<T> to the outer record object, and likely update a regional_ptr<F> field to point to other object
 // via the global_ptr<T>
 //
-// actually, you can do virtually nothing with a regional_ptr<F> alone, and this is by design
+// actually, you can do virtually nothing with a regional_ptr<F> alone, and this is by design, but read its offset (for
+// algorithms walking records bytewise, subgraph cloning e.g.), it can only be repointed via a global_ptr
 //
 template <typename VT> class regional_ptr final {
   template <typename OT, typename RT> friend class global_ptr;
@@ -57,10 +63,271 @@ public:
   regional_ptr &operator=(regional_ptr<VT> &&) = delete;
 
   explicit operator bool() const noexcept { return offset_ != 0; }
+
+  // offset of the target from the region of the record, 0 for null
+  size_t offset() const noexcept { return offset_; }
+};
+
+//
+// record types with regional_ptr fields should enumerate them with a static constexpr tuple of member pointers, e.g.
+//
+//   struct Node {
+//     regional_ptr<Node> next;
+//     regional_ptr<Leaf> leaf;
+//
+//     static constexpr auto REGIONAL_PTRS = std::make_tuple(&Node::next, &Node::leaf);
+//   };
+//
+// so generic algorithms (subgraph cloning e.g.) can follow the references out of a record,
+// record types without such a member are treated as leaves
+//
+template <typename T>
+concept HasRegionalPtrs = requires { std::tuple_size<std::remove_cvref_t<decltype(T::REGIONAL_PTRS)>>::value; };
+
+template <typename T> constexpr auto regional_ptrs_of() {
+  if constexpr (HasRegionalPtrs<T>) {
+    return T::REGIONAL_PTRS;
+  } else {
+    return std::tuple<>();
+  }
+}
+
+template <typename T> struct is_regional_ptr : std::false_type {};
+template <typename VT> struct is_regional_ptr<regional_ptr<VT>> : std::true_type {};
+
+template <typename M> struct regional_field_traits {
+  static constexpr bool valid = false;
+};
+template <typename T, typename F> struct regional_field_traits<regional_ptr<F> T::*> {
+  static constexpr bool valid = true;
+  typedef T record_type;
+  typedef F target_type;
+};
+
+template <typename T> consteval bool is_region_safe();
+
+//
+// completeness of REGIONAL_PTRS is checked by brace initializing the record from probes, one per leaf field (array
+// elements and members of nested aggregates are leaves of their own, via brace elision):
+//   - region_field_probe converts to region-safe leaf types only, counting the leaves
+//   - regional_ptr_probe converts to regional_ptrs only, telling which leaves are regional_ptrs
+//   - any_field_probe converts to anything, detecting a leaf beyond the count, i.e. of a type not region-safe
+//
+// so only aggregates are checked, and only up to MAX_PROBED_LEAVES leaf fields
+//
+constexpr size_t MAX_PROBED_LEAVES = 256;
+
+template <typename U>
+concept RegionSafeLeaf = std::is_arithmetic_v<U> || std::is_enum_v<U> || is_regional_ptr<U>::value ||
+                         (std::is_class_v<U> && !std::is_aggregate_v<U> && std::is_trivially_copyable_v<U> &&
+                          is_region_safe<U>());
+
+struct region_field_probe {
+  template <RegionSafeLeaf U> operator U() const;
+};
+
+struct regional_ptr_probe {
+  template <typename U>
+    requires is_regional_ptr<U>::value
+  operator U() const;
+};
+
+struct any_field_probe {
+  template <typename U> operator U() const;
+};
+
+// whether T{} takes sizeof...(Is) leaves, with AtP at leaf P and region_field_probe at the others
+template <typename T, typename AtP, size_t P, size_t... Is> consteval bool probe_leaves(std::index_sequence<Is...>) {
+  return requires { T{std::conditional_t<Is == P, AtP, region_field_probe>{}...}; };
+}
+
+// leaves without defaults can only be left out along with all leaves after them, so the initializable leaf counts form
+// a range, ending at the leaf count, or before the first leaf region_field_probe can not initialize
+template <typename T, size_t N = 0, bool INITIALIZED = false> consteval size_t probed_leaf_count() {
+  if constexpr (N > MAX_PROBED_LEAVES) {
+    return N;
+  } else {
+    constexpr bool initialized = probe_leaves<T, region_field_probe, N>(std::make_index_sequence<N>());
+    if constexpr (INITIALIZED && !initialized) {
+      return N - 1;
+    } else {
+      return probed_leaf_count<T, N + 1, INITIALIZED || initialized>();
+    }
+  }
+}
+
+template <typename A, typename B> consteval bool same_field(A a, B b) {
+  if constexpr (std::is_same_v<A, B>) {
+    return a == b;
+  } else {
+    return false;
+  }
+}
+
+// field J of REGIONAL_PTRS is a regional_ptr field of T itself, not listed before
+template <typename T, size_t J> consteval bool regional_ptr_listed() {
+  using fields = std::remove_cvref_t<decltype(T::REGIONAL_PTRS)>;
+  using field_traits = regional_field_traits<std::tuple_element_t<J, fields>>;
+  if constexpr (!field_traits::valid) {
+    return false;
+  } else if constexpr (!std::is_same_v<typename field_traits::record_type, T>) {
+    return false;
+  } else {
+    return []<size_t... K>(std::index_sequence<K...>) {
+      return !(same_field(std::get<K>(T::REGIONAL_PTRS), std::get<J>(T::REGIONAL_PTRS)) || ...);
+    }(std::make_index_sequence<J>());
+  }
+}
+
+template <typename T, size_t... J> consteval bool regional_ptrs_listed(std::index_sequence<J...>) {
+  return (regional_ptr_listed<T, J>() && ...);
+}
+
+// every regional_ptr field of T is listed in REGIONAL_PTRS
+template <typename T> consteval bool regional_ptrs_complete() {
+  if constexpr (!std::is_aggregate_v<T>) {
+    return false; // can not be probed
+  } else {
+    constexpr size_t leaves = probed_leaf_count<T>();
+    if constexpr (leaves > MAX_PROBED_LEAVES) {
+      return false;
+    } else if constexpr (probe_leaves<T, any_field_probe, leaves>(std::make_index_sequence<leaves + 1>())) {
+      return false; // a leaf not region-safe
+    } else {
+      constexpr size_t pointers = [&]<size_t... P>(std::index_sequence<P...>) {
+        return (size_t(probe_leaves<T, regional_ptr_probe, P>(std::make_index_sequence<leaves>())) + ... + 0);
+      }(std::make_index_sequence<leaves>());
+      return pointers == std::tuple_size_v<std::remove_cvref_t<decltype(T::REGIONAL_PTRS)>>;
+    }
+  }
+}
+
+template <typename T> consteval bool is_region_safe() {
+  if constexpr (std::is_array_v<T>) {
+    return is_region_safe<std::remove_cv_t<std::remove_all_extents_t<T>>>();
+  } else if constexpr (std::is_pointer_v<T> || std::is_reference_v<T> || std::is_member_function_pointer_v<T>) {
+    return false; // addresses are only meaningful in the process that took them
+  } else if constexpr (is_regional_ptr<T>::value) {
+    return true;
+  } else if constexpr (std::is_polymorphic_v<T> || !std::is_trivially_destructible_v<T>) {
+    return false; // vtable ptrs differ across processes, and destructors never run in a region
+  } else if constexpr (HasRegionalPtrs<T>) {
+    if constexpr (!regional_ptrs_listed<T>(
+                      std::make_index_sequence<std::tuple_size_v<std::remove_cvref_t<decltype(T::REGIONAL_PTRS)>>>())) {
+      return false;
+    } else {
+      return regional_ptrs_complete<T>();
+    }
+  } else {
+    // regional_ptr is non-copyable, so a copyable type has no regional_ptr field
+    return std::is_trivially_copyable_v<T> && std::is_copy_constructible_v<T>;
+  }
+}
+
+//
+// types meaningful to live in a memory region, i.e. still valid when mapped at another address or in another process,
+// and bytewise relocatable to another region with only their regional_ptr fields fixed up:
+//   - no raw pointers or references
+//   - no vtables
+//   - trivially destructible, and either trivially copyable, or an aggregate having all its regional_ptr fields
+//     enumerated by REGIONAL_PTRS, as direct members, and all other (leaf) fields region-safe
+//
+// NOTE: raw pointers nested in a trivially copyable class can not be detected without reflection,
+//       and records with REGIONAL_PTRS can not have constructors, nor more than MAX_PROBED_LEAVES leaf fields
+//       (wrap large arrays in a trivially copyable class with a constructor, to make them a single leaf)
+//
+template <typename T>
+concept RegionSafe = is_region_safe<std::remove_cv_t<T>>();
+
+//
+// containers keeping bare offsets into their region (of their nodes, or of the objects they hold), instead of
+// regional_ptr fields, declare it with
+//
+//   static constexpr bool OPAQUE_OFFSETS = true;
+//
+// they are region-safe where they are, but bytewise relocation (subgraph cloning) leaves their offsets dangling, and
+// walks following REGIONAL_PTRS (bulk migration) can't see what they reference, so both refuse records holding one
+//
+// NOTE: only aggregates are looked into, as for REGIONAL_PTRS completeness, a container held by a class with a
+//       constructor goes undetected
+//
+template <typename T>
+concept DeclaresOpaqueOffsets = requires { requires bool(T::OPAQUE_OFFSETS); };
+
+struct opaque_offsets_probe {
+  template <typename U>
+    requires DeclaresOpaqueOffsets<U>
+  operator U() const;
+};
+
+template <typename T> consteval bool holds_opaque_offsets() {
+  if constexpr (std::is_array_v<T>) {
+    return holds_opaque_offsets<std::remove_cv_t<std::remove_all_extents_t<T>>>();
+  } else if constexpr (DeclaresOpaqueOffsets<T>) {
+    return true;
+  } else if constexpr (!std::is_aggregate_v<T>) {
+    return false;
+  } else {
+    constexpr size_t leaves = probed_leaf_count<T>();
+    if constexpr (leaves > MAX_PROBED_LEAVES) {
+      return false;
+    } else {
+      return [&]<size_t... P>(std::index_sequence<P...>) {
+        return (probe_leaves<T, opaque_offsets_probe, P>(std::make_index_sequence<leaves>()) || ...);
+      }(std::make_index_sequence<leaves>());
+    }
+  }
+}
+
+// byte offset of a data member, at compile time, by locating it in the storage of a T
+template <typename T, typename M> consteval size_t member_offset(M T::*member) {
+  union storage {
+    std::byte bytes[sizeof(T)];
+    T obj;
+    constexpr storage() : bytes{} {}
+  } s;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    if (static_cast<const void *>(&s.bytes[i]) == static_cast<const void *>(&(s.obj.*member)))
+      return i;
+  }
+  return sizeof(T);
+}
+
+// whether the B base of a D sits at offset 0 in it, at compile time
+template <typename B, typename D> consteval bool base_at_offset_zero() {
+  union storage {
+    std::byte bytes[sizeof(D)];
+    D obj;
+    constexpr storage() : bytes{} {}
+  } s;
+  return static_cast<const void *>(static_cast<const B *>(&s.obj)) == static_cast<const void *>(&s.obj);
+}
+
+//
+// the pointer map of a region-safe type, derived from its REGIONAL_PTRS
+//
+// bulk operations can take plain memcpy paths for pointer_free types,
+// and visit only the regional_ptr slots at offsets otherwise
+//
+template <typename T>
+  requires RegionSafe<T>
+struct regional_ptr_map {
+  static constexpr auto fields = regional_ptrs_of<T>();
+  static constexpr size_t count = std::tuple_size_v<std::remove_cv_t<decltype(fields)>>;
+  static constexpr bool pointer_free = count == 0;
+
+  template <size_t I>
+  using target_type =
+      typename regional_field_traits<std::tuple_element_t<I, std::remove_cv_t<decltype(fields)>>>::target_type;
+
+  // byte offsets of the regional_ptr fields within a T, in REGIONAL_PTRS order
+  static constexpr std::array<size_t, count> offsets = []<size_t... I>(std::index_sequence<I...>) {
+    return std::array<size_t, count>{member_offset(std::get<I>(fields))...};
+  }(std::make_index_sequence<count>());
 };
 
 template <typename RT>
-concept ValidMemRegionRootType = requires {
+concept ValidMemRegionRootType = RegionSafe<RT> && requires {
   { RT::TYPE_UUID } -> std::same_as<const UUID &>;
 };
 
@@ -111,6 +378,14 @@ public:
   size_t occupation() const { return occupation_; }
   size_t free_capacity() const { return capacity_ - occupation_; }
 
+  // the memory of the region was extended by its owner, e.g. an image loaded into a larger allocation
+  void grow_capacity(size_t capacity) {
+    if (capacity < capacity_) {
+      throw std::logic_error("!?shrinking a region?!");
+    }
+    capacity_ = capacity;
+  }
+
   void *allocate(const size_t size, const size_t align) {
     // use current occupation mark as the allocated ptr, do proper alignment
     size_t free_spc = free_capacity();
@@ -123,7 +398,9 @@ public:
     return ptr;
   }
 
-  template <typename VT, typename... Args> global_ptr<VT, RT> create(Args &&...args) {
+  template <typename VT, typename... Args>
+    requires RegionSafe<VT>
+  global_ptr<VT, RT> create(Args &&...args) {
     void *ptr = this->allocate(sizeof(VT), alignof(VT));
     if (!ptr)
       throw std::bad_alloc();
@@ -133,14 +410,44 @@ public:
         reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(this));
   }
 
+  // bytewise copy of an object within this region, its regional_ptr fields are region-relative, so the copy points to
+  // the same targets, e.g. for copy-on-write updates
+  template <typename VT>
+    requires RegionSafe<VT>
+  global_ptr<VT, RT> duplicate(const global_ptr<VT, RT> &obj) {
+    if (obj.region_ != this) {
+      throw std::logic_error("!?cross region duplicate?!");
+    }
+    void *ptr = this->allocate(sizeof(VT), alignof(VT));
+    std::memcpy(ptr, obj.get(), sizeof(VT));
+    return global_ptr<VT, RT>( //
+        this,                  //
+        reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(this));
+  }
+
   global_ptr<RT, RT> root() { return global_ptr<RT, RT>(this, ro_offset_); }
-  const global_ptr<RT, RT> root() const { return global_ptr<RT, RT>(this, ro_offset_); }
+  const global_ptr<RT, RT> root() const {
+    return global_ptr<RT, RT>(const_cast<memory_region<RT> *>(this), ro_offset_);
+  }
+
+  // repoint the root, e.g. to an upgraded copy of it
+  void set_root(const global_ptr<RT, RT> &root) {
+    if (root.region_ != this || !root) {
+      throw std::logic_error("!?root out of the region?!");
+    }
+    ro_offset_ = root.offset_;
+  }
 
   template <typename VT> global_ptr<VT, RT> null() { return global_ptr<VT, RT>(this, 0); }
-  template <typename VT> const global_ptr<VT, RT> null() const { return global_ptr<VT, RT>(this, 0); }
+  template <typename VT> const global_ptr<VT, RT> null() const {
+    return global_ptr<VT, RT>(const_cast<memory_region<RT> *>(this), 0);
+  }
 };
 
 template <typename VT, typename RT> class global_ptr final {
+  template <typename OT, typename RT1> friend class global_ptr;
+  friend class memory_region<RT>;
+
 public:
   typedef VT target_type;
   typedef RT root_type;
@@ -159,28 +466,56 @@ public:
   global_ptr &operator=(const global_ptr<VT, RT> &) = default;
   global_ptr &operator=(global_ptr<VT, RT> &&) = default;
 
+  // the pointer to a VT at an offset into a region (0 for null), e.g. kept bare by a container, checked to be within
+  // the occupied part of the region, not to be a VT there
+  static global_ptr from_offset(memory_region<RT> *region, size_t offset) {
+    if (offset != 0 && (offset > region->occupation() || sizeof(VT) > region->occupation() - offset)) {
+      throw std::logic_error("!?offset out of occupied range?!");
+    }
+    return global_ptr(region, offset);
+  }
+
+  memory_region<RT> *region() const noexcept { return region_; }
+  size_t offset() const noexcept { return offset_; }
+
+  // point a regional_ptr field of a record not (yet) in a region to the target, e.g. of a record being built off
+  // region, to be copied into the region this pointer is of
+  void assign_to(regional_ptr<VT> &field, const memory_region<RT> *region) const {
+    if (region != region_) {
+      throw std::logic_error("!?cross region ptr assignment?!");
+    }
+    field.offset_ = offset_;
+  }
+
+  // upcast from a derived record of a poly_family, the poly_object base always lives at offset 0
+  template <typename OT>
+    requires(std::is_base_of_v<poly_object, VT> && std::is_base_of_v<VT, OT>)
+  global_ptr(const global_ptr<OT, RT> &other) : region_(other.region_), offset_(other.offset_) {
+    static_assert(base_at_offset_zero<VT, OT>(), "!?poly upcast needs the base at offset 0?!");
+  }
+
   template <typename F> //
   void clear(regional_ptr<F> VT::*ptrField) {
-    this->*ptrField.offset_ = 0;
+    (get()->*ptrField).offset_ = 0;
   }
 
   template <typename F> //
-  const global_ptr<F, RT> &set(regional_ptr<F> VT::*ptrField, const global_ptr<F, RT> &tgt) {
+  global_ptr<F, RT> set(regional_ptr<F> VT::*ptrField, const std::type_identity_t<global_ptr<F, RT>> &tgt) {
     if (tgt.region_ != region_) {
       throw std::logic_error("!?cross region ptr assignment?!");
     }
-    this->*ptrField.offset_ = tgt.offset_;
+    (get()->*ptrField).offset_ = tgt.offset_;
     return tgt;
   }
 
   template <typename F> //
   global_ptr<F, RT> get(regional_ptr<F> VT::*ptrField) {
-    return global_ptr<F, RT>(region_, this->*ptrField.offset_);
+    return global_ptr<F, RT>(region_, (get()->*ptrField).offset_);
   }
 
   template <typename F> //
   const global_ptr<F, RT> get(regional_ptr<F> VT::*ptrField) const {
-    return global_ptr<F, RT>(region_, this->*ptrField.offset_);
+    return global_ptr<F, RT>(region_, (get()->*ptrField).offset_);
   }
 
   VT *get() {
@@ -0,0 +1,166 @@
+
+#pragma once
+
+#include "./region.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace shilos {
+
+template <typename RT>
+  requires ValidMemRegionRootType<RT>
+class region_handle;
+
+//
+// process-wide cache of DBMR file mappings
+//
+// one mapping is shared per (file, mode), files are identified by device and inode, so different paths to the same file
+// share its mapping, opening an already mapped file costs a stat() and a hash lookup to revalidate it (by size, and
+// mtime for readonly mappings) instead of open+fstat+mmap, unreferenced mappings stay cached, and are unmapped in LRU
+// order once the total mapped size exceeds the address space budget
+//
+// a mapping found stale while still referenced is detached, existing handles keep using it until released, while new
+// handles get a fresh mapping of the current file
+//
+class region_pool {
+  template <typename RT>
+    requires ValidMemRegionRootType<RT>
+  friend class region_handle;
+
+public:
+  static constexpr size_t DEFAULT_BUDGET = size_t(64) << 30;
+
+  static region_pool &instance();
+
+  template <typename RT> region_handle<RT> open(const std::string &file_name, bool writable = false);
+
+  // unmaps unreferenced mappings in LRU order, until within the new budget
+  void set_budget(size_t bytes);
+  size_t budget() const;
+
+  size_t mapped_bytes() const;
+  size_t cached_count() const;
+
+  // unmaps all unreferenced mappings
+  void purge();
+
+private:
+  struct entry;
+
+  struct file_key {
+    uint64_t dev;
+    uint64_t ino;
+    bool writable;
+
+    bool operator==(const file_key &) const = default;
+  };
+
+  struct file_key_hash {
+    size_t operator()(const file_key &k) const noexcept {
+      return std::hash<uint64_t>()(k.ino * 0x9E3779B97F4A7C15ULL ^ k.dev) ^ size_t(k.writable);
+    }
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<file_key, entry *, file_key_hash> index_;
+  // unreferenced mappings, most recently used first
+  entry *head_ = nullptr;
+  entry *tail_ = nullptr;
+  size_t budget_ = DEFAULT_BUDGET;
+  size_t mapped_bytes_ = 0;
+
+  region_pool() = default;
+  ~region_pool() = default;
+  region_pool(const region_pool &) = delete;
+  region_pool &operator=(const region_pool &) = delete;
+
+  entry *acquire(const std::string &file_name, bool writable, size_t min_size);
+  void release(entry *e);
+
+  static void *mapped_addr(const entry *e);
+  static size_t mapped_size(const entry *e);
+  static bool writable(const entry *e);
+
+  void push_front(entry *e);
+  void unlink(entry *e);
+  void drop_locked(entry *e);
+  void evict_locked(size_t budget);
+  void unmap(entry *e);
+};
+
+// move-only reference to a pooled mapping
+template <typename RT>
+  requires ValidMemRegionRootType<RT>
+class region_handle {
+  friend class region_pool;
+
+private:
+  region_pool::entry *entry_;
+
+  explicit region_handle(region_pool::entry *e) : entry_(e) {}
+
+public:
+  region_handle() : entry_(nullptr) {}
+  ~region_handle() { reset(); }
+
+  region_handle(const region_handle &) = delete;
+  region_handle &operator=(const region_handle &) = delete;
+
+  region_handle(region_handle &&other) noexcept : entry_(other.entry_) { other.entry_ = nullptr; }
+  region_handle &operator=(region_handle &&other) noexcept {
+    if (this != &other) {
+      reset();
+      entry_ = other.entry_;
+      other.entry_ = nullptr;
+    }
+    return *this;
+  }
+
+  void reset() {
+    if (entry_) {
+      region_pool::instance().release(entry_);
+      entry_ = nullptr;
+    }
+  }
+
+  bool writable() const { return entry_ && region_pool::writable(entry_); }
+
+  memory_region<RT> *region() {
+    if (!entry_)
+      return nullptr;
+    if (!region_pool::writable(entry_)) {
+      throw std::logic_error("!?mutable access to a readonly pooled region?!");
+    }
+    return static_cast<memory_region<RT> *>(region_pool::mapped_addr(entry_));
+  }
+  const memory_region<RT> *region() const {
+    return entry_ ? static_cast<const memory_region<RT> *>(region_pool::mapped_addr(entry_)) : nullptr;
+  }
+
+  explicit operator bool() const noexcept { return entry_ != nullptr; }
+};
+
+template <typename RT> region_handle<RT> region_pool::open(const std::string &file_name, bool writable) {
+  region_handle<RT> handle(acquire(file_name, writable, sizeof(memory_region<RT>)));
+  // cheap enough to redo on every open, no syscall involved
+  const memory_region<RT> *region = std::as_const(handle).region();
+  if (region->occupation() > mapped_size(handle.entry_)) { // this is insane
+    throw std::logic_error("!?DBMR occupied more than the file size?!");
+  }
+  if (region->capacity() > mapped_size(handle.entry_)) {
+    throw std::logic_error("!?DBMR capacity exceeds the file size?!");
+  }
+  if (region->root_type_uuid() != RT::TYPE_UUID) {
+    throw std::runtime_error(std::string("Root Type mismatch: ") + region->root_type_uuid().to_string() +
+                             " vs expected " + RT::TYPE_UUID.to_string());
+  }
+  return handle;
+}
+
+} // namespace shilos
@@ -0,0 +1,166 @@
+
+#pragma once
+
+#include "./futex.hh"
+#include "./region.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+namespace shilos {
+
+//
+// bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's), to live in a region shared by processes,
+// a DBMR or an anonymous (memfd) one, e.g. created with region->create<region_ring<Job, 1024>>()
+//
+// std::atomic is not trivially copyable thus not region-safe, the ring keeps plain integers and accesses them through
+// std::atomic_ref instead, the fast path is a CAS plus a store, blocking push()/pop() spin a little before waiting on
+// futexes in the region, and waiters are only woken (a syscall) when there are some
+//
+// NOTE: a process dying between claiming a cell and publishing it stalls the ring at that cell
+//
+template <typename T, size_t CAPACITY>
+  requires RegionSafe<T> && std::is_trivially_copyable_v<T> && (CAPACITY >= 2) && ((CAPACITY & (CAPACITY - 1)) == 0)
+class region_ring {
+  struct cell {
+    uint64_t sequence;
+    T value;
+  };
+
+  // the futex word to wait on for a condition, and the count of its waiters
+  struct wait_point {
+    uint32_t seq;
+    uint32_t waiters;
+  };
+
+  alignas(64) uint64_t enqueue_pos_;
+  alignas(64) uint64_t dequeue_pos_;
+  alignas(64) wait_point not_empty_;
+  alignas(64) wait_point not_full_;
+  alignas(64) cell cells_[CAPACITY];
+
+  static constexpr int SPINS = 64;
+
+  template <typename I> static std::atomic_ref<I> ref(I &i) { return std::atomic_ref<I>(i); }
+
+  static void notify(wait_point &wp) {
+    // pairs with the registration of a waiter, either it sees the new item/room, or we see it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ref(wp.waiters).load(std::memory_order_relaxed) == 0)
+      return;
+    ref(wp.seq).fetch_add(1, std::memory_order_release);
+    futex_wake(&wp.seq, 1);
+  }
+
+  template <typename TryOp>
+  static bool wait_until(wait_point &wp, TryOp &&try_op, std::chrono::steady_clock::time_point deadline,
+                         bool forever) {
+    for (int i = 0; i < SPINS; ++i) {
+      if (try_op())
+        return true;
+      std::this_thread::yield();
+    }
+    for (;;) {
+      const uint32_t seq = ref(wp.seq).load(std::memory_order_acquire);
+      ref(wp.waiters).fetch_add(1, std::memory_order_seq_cst);
+      if (try_op()) {
+        ref(wp.waiters).fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      std::chrono::nanoseconds timeout(-1);
+      if (!forever) {
+        timeout = deadline - std::chrono::steady_clock::now();
+        if (timeout.count() <= 0) {
+          ref(wp.waiters).fetch_sub(1, std::memory_order_relaxed);
+          return false;
+        }
+      }
+      futex_wait(&wp.seq, seq, timeout);
+      ref(wp.waiters).fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+public:
+  region_ring() : enqueue_pos_(0), dequeue_pos_(0), not_empty_{0, 0}, not_full_{0, 0} {
+    for (size_t i = 0; i < CAPACITY; ++i)
+      cells_[i].sequence = i;
+  }
+
+  static constexpr size_t capacity() { return CAPACITY; }
+
+  bool try_push(const T &value) {
+    cell *c;
+    uint64_t pos = ref(enqueue_pos_).load(std::memory_order_relaxed);
+    for (;;) {
+      c = &cells_[pos & (CAPACITY - 1)];
+      const uint64_t seq = ref(c->sequence).load(std::memory_order_acquire);
+      const int64_t dif = int64_t(seq - pos);
+      if (dif == 0) {
+        if (ref(enqueue_pos_).compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false; // full
+      } else {
+        pos = ref(enqueue_pos_).load(std::memory_order_relaxed);
+      }
+    }
+    std::memcpy(static_cast<void *>(&c->value), &value, sizeof(T));
+    ref(c->sequence).store(pos + 1, std::memory_order_release);
+    notify(not_empty_);
+    return true;
+  }
+
+  bool try_pop(T &value) {
+    cell *c;
+    uint64_t pos = ref(dequeue_pos_).load(std::memory_order_relaxed);
+    for (;;) {
+      c = &cells_[pos & (CAPACITY - 1)];
+      const uint64_t seq = ref(c->sequence).load(std::memory_order_acquire);
+      const int64_t dif = int64_t(seq - (pos + 1));
+      if (dif == 0) {
+        if (ref(dequeue_pos_).compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false; // empty
+      } else {
+        pos = ref(dequeue_pos_).load(std::memory_order_relaxed);
+      }
+    }
+    std::memcpy(static_cast<void *>(&value), &c->value, sizeof(T));
+    ref(c->sequence).store(pos + CAPACITY, std::memory_order_release);
+    notify(not_full_);
+    return true;
+  }
+
+  // block while full
+  void push(const T &value) {
+    wait_until(not_full_, [&] { return try_push(value); }, {}, true);
+  }
+
+  // block while empty
+  void pop(T &value) {
+    wait_until(not_empty_, [&] { return try_pop(value); }, {}, true);
+  }
+
+  template <typename Rep, typename Period> bool push_for(const T &value, std::chrono::duration<Rep, Period> timeout) {
+    return wait_until(not_full_, [&] { return try_push(value); }, std::chrono::steady_clock::now() + timeout, false);
+  }
+
+  template <typename Rep, typename Period> bool pop_for(T &value, std::chrono::duration<Rep, Period> timeout) {
+    return wait_until(not_empty_, [&] { return try_pop(value); }, std::chrono::steady_clock::now() + timeout, false);
+  }
+
+  // racy by nature, exact when quiescent
+  size_t size_approx() const {
+    const uint64_t enq = ref(const_cast<uint64_t &>(enqueue_pos_)).load(std::memory_order_relaxed);
+    const uint64_t deq = ref(const_cast<uint64_t &>(dequeue_pos_)).load(std::memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+  }
+};
+
+} // namespace shilos
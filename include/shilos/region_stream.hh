@@ -0,0 +1,131 @@
+
+#pragma once
+
+#include "./bulk_io.hh"
+#include "./region.hh"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace shilos {
+
+struct stream_options {
+  // bytes read per chunk, also the largest object that can straddle two chunks
+  size_t buffer_size = size_t(16) << 20;
+  // chunks read ahead of the one being consumed
+  unsigned read_ahead = 2;
+  // evict consumed file ranges from the page cache
+  bool drop_behind = true;
+  bulk_io_options io;
+};
+
+//
+// a window of a region streamed from its file, offsets are region offsets (the same as file offsets)
+//
+class stream_chunk {
+public:
+  size_t offset = 0;
+  const std::byte *data = nullptr;
+  size_t size = 0;
+
+  bool contains(size_t at, size_t len) const { return offset <= at && at + len <= offset + size; }
+
+  // the object at a region offset, nullptr unless it lies wholly within this chunk
+  template <typename VT> const VT *at(size_t region_offset) const {
+    if (!contains(region_offset, sizeof(VT)))
+      return nullptr;
+    return reinterpret_cast<const VT *>(data + (region_offset - offset));
+  }
+
+  // the object a regional_ptr refers to, nullptr for a null pointer or a target outside this chunk
+  template <typename VT> const VT *get(const regional_ptr<VT> &ptr) const {
+    if (ptr.offset() == 0)
+      return nullptr;
+    return at<VT>(ptr.offset());
+  }
+
+  template <typename VT> size_t offset_of(const regional_ptr<VT> &ptr) const { return ptr.offset(); }
+};
+
+//
+// sequential reader of [0, end) of a file, through large aligned buffers filled ahead by a background thread,
+// evicting consumed ranges from the page cache behind itself, so a full scan of a file larger than RAM runs at
+// disk bandwidth without thrashing the page cache for other workloads
+//
+// a region has no per-object headers, so scans proceed chunk by chunk in allocation order, the caller decodes the
+// objects it knows the layout of, and when one straddles the chunk end, calls resume_at(its offset) so the next
+// chunk starts there
+//
+class stream_reader {
+public:
+  stream_reader(const std::string &file_name, size_t end, const stream_options &opts = stream_options());
+  ~stream_reader();
+
+  stream_reader(const stream_reader &) = delete;
+  stream_reader &operator=(const stream_reader &) = delete;
+
+  // the next chunk, false at the end of stream, rethrows read failures of the background thread
+  bool next(stream_chunk &chunk);
+
+  // have the next chunk start at offset, which must lie within the current chunk
+  void resume_at(size_t offset);
+
+  size_t end() const { return end_; }
+
+private:
+  struct buffer {
+    std::byte *mem;   // carry room followed by buffer_size bytes of data
+    size_t pos = 0;   // file offset of the data
+    size_t len = 0;
+  };
+
+  std::string file_name_;
+  bulk_io_session io_; // one ring for all the chunks read ahead, set up before the file is opened
+  int fd_;
+  size_t end_;
+  stream_options opts_;
+  size_t carry_room_;
+
+  std::vector<buffer> buffers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<int> free_;  // buffers for the reader thread to fill
+  std::deque<int> ready_; // filled buffers in file order
+  bool reader_done_ = false;
+  bool stop_ = false;
+  std::exception_ptr failure_;
+  std::thread reader_;
+
+  int current_ = -1;
+  size_t current_offset_ = 0; // of the current chunk, carry included
+  size_t resume_ = 0;         // carry from here on into the next chunk, == end of current chunk for none
+
+  void read_ahead();
+};
+
+//
+// stream_reader over the occupied part of a DBMR file, validating its header
+//
+template <typename RT>
+  requires ValidMemRegionRootType<RT>
+class region_stream : public stream_reader {
+  region_header header_;
+
+  region_stream(const std::string &file_name, const region_header &header, const stream_options &opts)
+      : stream_reader(file_name, header.occupation, opts), header_(header) {}
+
+public:
+  region_stream(const std::string &file_name, const stream_options &opts = stream_options())
+      : region_stream(file_name, region_image<RT>::read_header(file_name), opts) {}
+
+  const region_header &header() const { return header_; }
+  size_t root_offset() const { return header_.root_offset; }
+};
+
+} // namespace shilos
@@ -0,0 +1,144 @@
+
+#pragma once
+
+#include "./dbmr.hh"
+#include "./region.hh"
+#include "./uuid.hh"
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+
+namespace shilos {
+
+// read the root type UUID of a region file without mapping it, false with ec set on I/O errors, or with ec clear if
+// the file is too short to be a region
+bool read_root_type_uuid(const std::string &file_name, UUID &out, std::error_code &ec) noexcept;
+
+//
+// compile-time registry of known root types, keyed by their TYPE_UUIDs, e.g. for tools scanning directories full of
+// mixed region files, to classify and open each with its proper root type, without trial opens failing on mismatches
+//
+//   typedef root_registry<CodProject, BuildCache> KnownRoots;
+//   KnownRoots::read(file, [](const auto &dbmr) { ... }); // dbmr is a const DBMR<RT> & of the file's root type
+//
+// lookups go through a perfect hash computed at compile time over the TYPE_UUIDs: one hash, one table slot and one
+// UUID comparison, whatever the number of types
+//
+template <typename... RTs>
+  requires(sizeof...(RTs) > 0) && (ValidMemRegionRootType<RTs> && ...)
+class root_registry {
+public:
+  static constexpr size_t size = sizeof...(RTs);
+  static constexpr UUID TYPE_UUIDS[size] = {RTs::TYPE_UUID...};
+
+  template <size_t I> using root_type = std::tuple_element_t<I, std::tuple<RTs...>>;
+
+private:
+  static constexpr size_t TABLE_SIZE = std::bit_ceil(size) * 4;
+
+  static constexpr uint64_t hash(const UUID &uuid, uint64_t seed) {
+    uint64_t a = 0, b = 0;
+    for (size_t i = 0; i < 8; ++i) {
+      a |= uint64_t(uuid.byte(i)) << (8 * i);
+      b |= uint64_t(uuid.byte(8 + i)) << (8 * i);
+    }
+    uint64_t h = (a ^ seed) * 0x9E3779B97F4A7C15ULL ^ b;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  struct perfect_hash {
+    uint64_t seed;
+    std::array<uint16_t, TABLE_SIZE> slots; // type index + 1, 0 for none
+  };
+
+  static consteval perfect_hash build() {
+    for (uint64_t seed = 0; seed < 1 << 20; ++seed) {
+      perfect_hash ph{seed, {}};
+      bool collided = false;
+      for (size_t i = 0; i < size && !collided; ++i) {
+        auto &slot = ph.slots[hash(TYPE_UUIDS[i], seed) % TABLE_SIZE];
+        if (slot != 0)
+          collided = true;
+        else
+          slot = uint16_t(i + 1);
+      }
+      if (!collided)
+        return ph;
+    }
+    throw std::logic_error("!?no perfect hash for root types, duplicate TYPE_UUIDs?!");
+  }
+
+  static constexpr perfect_hash PH = build();
+
+  template <typename RT, typename R, typename F> static R invoke_type(F &f) { return f(std::type_identity<RT>()); }
+
+public:
+  // index of the root type with type_uuid, none if unknown
+  static constexpr std::optional<size_t> index_of(const UUID &type_uuid) {
+    const uint16_t slot = PH.slots[hash(type_uuid, PH.seed) % TABLE_SIZE];
+    if (slot == 0 || TYPE_UUIDS[slot - 1] != type_uuid)
+      return std::nullopt;
+    return slot - 1;
+  }
+
+  template <typename RT> static constexpr bool contains = (std::is_same_v<RT, RTs> || ...);
+
+  // call f(std::type_identity<RT>()) for the root type at index
+  template <typename F> static decltype(auto) visit_type(size_t index, F &&f) {
+    using R = std::invoke_result_t<F &, std::type_identity<root_type<0>>>;
+    static constexpr R (*TABLE[size])(F &) = {&invoke_type<RTs, R, F>...};
+    if (index >= size)
+      throw std::out_of_range("!?root type index out of registry?!");
+    return TABLE[index](f);
+  }
+
+  // index of the root type of a region file, none if unknown or not a region, throws only on I/O errors
+  static std::optional<size_t> classify(const std::string &file_name) {
+    UUID uuid = UUID::nil();
+    std::error_code ec;
+    if (!read_root_type_uuid(file_name, uuid, ec)) {
+      if (ec)
+        throw std::system_error(ec, "Failed to read file: " + file_name);
+      return std::nullopt;
+    }
+    return index_of(uuid);
+  }
+
+  // open a region file of any registered root type read-only, and call f(const DBMR<RT> &) with it,
+  // returns false (without calling f) if the root type is unknown
+  template <typename F> static bool read(const std::string &file_name, F &&f) {
+    const auto index = classify(file_name);
+    if (!index)
+      return false;
+    visit_type(*index, [&]<typename RT>(std::type_identity<RT>) {
+      const DBMR<RT> dbmr = DBMR<RT>::read(file_name);
+      f(dbmr);
+    });
+    return true;
+  }
+
+  // open a region file of any registered root type writable, and call f(DBMR<RT> &) with it,
+  // returns false (without calling f) if the root type is unknown
+  template <typename F> static bool open(const std::string &file_name, size_t reserve_free_capacity, F &&f) {
+    const auto index = classify(file_name);
+    if (!index)
+      return false;
+    visit_type(*index, [&]<typename RT>(std::type_identity<RT>) {
+      DBMR<RT> dbmr(file_name, reserve_free_capacity);
+      f(dbmr);
+    });
+    return true;
+  }
+};
+
+} // namespace shilos
@@ -0,0 +1,464 @@
+
+#pragma once
+
+#include "./durability.hh"
+#include "./region.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace shilos {
+
+template <typename RT>
+  requires ValidMemRegionRootType<RT>
+class SDBMR;
+
+template <typename VT, typename RT> class segmented_ptr;
+
+//
+// pointer fields of data structures meant to live in a segmented DBMR, may point into any segment of the same store
+//
+// the value packs a segment index and the offset within that segment, so unlike regional_ptr, it stays meaningful
+// when copied to another record of the same store, but never across stores
+//
+template <typename VT> class segmental_ptr final {
+  template <typename OT, typename RT> friend class segmented_ptr;
+
+public:
+  typedef VT target_type;
+
+private:
+  uint64_t packed_;
+
+  segmental_ptr(uint64_t packed) : packed_(packed) {}
+
+public:
+  segmental_ptr() : packed_(0) {}
+
+  explicit operator bool() const noexcept { return packed_ != 0; }
+};
+
+// Segmented Disk Backed Memory Region
+//
+// a manifest file lists N segment files, each mapped separately and only when first touched, so opening a huge store
+// maps nothing but what's accessed, and appending a segment never remaps existing ones
+//
+// segment files can live on different filesystems/disks, relative paths in the manifest are resolved against the
+// directory of the manifest file
+//
+// NOTE: records of a segmented DBMR reference each other with segmental_ptr fields, accessed via segmented_ptr, not
+//       with regional_ptr/global_ptr, which stay single region, so the region tooling built on those (REGIONAL_PTRS
+//       maps, subgraph cloning, poly upcasts, migration) does not apply to segmented stores, RegionSafe only vets
+//       their records for raw pointers and vtables
+//
+template <typename RT>
+  requires ValidMemRegionRootType<RT>
+class SDBMR {
+  template <typename VT, typename RT1> friend class segmented_ptr;
+
+public:
+  static constexpr uint32_t MAX_SEGMENTS = 4096;
+  static constexpr unsigned OFFSET_BITS = 52;
+  static constexpr uint64_t OFFSET_MASK = (uint64_t(1) << OFFSET_BITS) - 1;
+
+  static constexpr char MANIFEST_MAGIC[16] = "SHILOS-SDBMR-01";
+
+private:
+  struct manifest_header {
+    char magic[16];
+    UUID rt_uuid;
+    uint32_t n_segments;
+    uint32_t reserved;
+    uint64_t root;
+    uint64_t segment_capacity;
+  };
+
+  struct segment_header {
+    UUID rt_uuid_;
+    uint32_t index_;
+    uint32_t reserved_;
+    size_t capacity_;
+    size_t occupation_;
+  };
+
+  struct segment {
+    std::string path; // as recorded in the manifest
+    size_t capacity;
+    int fd = -1;
+    std::atomic<segment_header *> header{nullptr};
+  };
+
+  std::string file_name_;
+  bool writable_;
+  uint64_t root_;
+  size_t segment_capacity_;
+
+  // reserved to MAX_SEGMENTS upfront, so lazy mapping can index it without locking, concurrently with appending
+  std::vector<std::unique_ptr<segment>> segments_;
+  std::atomic<uint32_t> n_segments_;
+  mutable std::mutex mutex_;
+
+  static uint64_t pack(uint32_t seg, size_t offset) { return (uint64_t(seg) << OFFSET_BITS) | offset; }
+
+  std::string resolve_path(const std::string &seg_path) const {
+    if (!seg_path.empty() && seg_path[0] == '/')
+      return seg_path;
+    const auto slash = file_name_.rfind('/');
+    if (slash == std::string::npos)
+      return seg_path;
+    return file_name_.substr(0, slash + 1) + seg_path;
+  }
+
+  std::string default_segment_path(uint32_t seg) const {
+    const auto slash = file_name_.rfind('/');
+    return (slash == std::string::npos ? file_name_ : file_name_.substr(slash + 1)) + "." + std::to_string(seg);
+  }
+
+  SDBMR(const std::string &file_name, bool writable)
+      : file_name_(file_name), writable_(writable), root_(0), segment_capacity_(0), n_segments_(0) {
+    segments_.reserve(MAX_SEGMENTS);
+  }
+
+  void load_manifest() {
+    std::ifstream in(file_name_, std::ios::binary);
+    if (!in) {
+      throw std::system_error(errno, std::system_category(), "Failed to open file: " + file_name_);
+    }
+    manifest_header mh;
+    if (!in.read(reinterpret_cast<char *>(&mh), sizeof(mh)) ||
+        std::memcmp(mh.magic, MANIFEST_MAGIC, sizeof(mh.magic)) != 0) {
+      throw std::runtime_error("Not a segmented DBMR manifest: " + file_name_);
+    }
+    if (mh.rt_uuid != RT::TYPE_UUID) {
+      throw std::runtime_error(std::string("Root Type mismatch: ") + mh.rt_uuid.to_string() + " vs expected " +
+                               RT::TYPE_UUID.to_string());
+    }
+    if (mh.n_segments == 0 || mh.n_segments > MAX_SEGMENTS) {
+      throw std::logic_error("!?SDBMR manifest with invalid segment count?!");
+    }
+    root_ = mh.root;
+    segment_capacity_ = mh.segment_capacity;
+    for (uint32_t i = 0; i < mh.n_segments; ++i) {
+      uint64_t capacity;
+      uint32_t path_len;
+      in.read(reinterpret_cast<char *>(&capacity), sizeof(capacity));
+      in.read(reinterpret_cast<char *>(&path_len), sizeof(path_len));
+      std::string path(path_len, '\0');
+      in.read(path.data(), path_len);
+      if (!in) {
+        throw std::runtime_error("Truncated segmented DBMR manifest: " + file_name_);
+      }
+      auto seg = std::make_unique<segment>();
+      seg->path = std::move(path);
+      seg->capacity = capacity;
+      segments_.push_back(std::move(seg));
+    }
+    n_segments_.store(mh.n_segments, std::memory_order_release);
+  }
+
+  // rewritten as a whole, synced and renamed into place, so the manifest is never seen half updated, even after a crash
+  void save_manifest(uint32_t n_segments) const {
+    const std::string tmp_name = file_name_ + ".tmp";
+    {
+      std::ofstream out(tmp_name, std::ios::binary | std::ios::trunc);
+      manifest_header mh{};
+      std::memcpy(mh.magic, MANIFEST_MAGIC, sizeof(mh.magic));
+      mh.rt_uuid = RT::TYPE_UUID;
+      mh.n_segments = n_segments;
+      mh.root = root_;
+      mh.segment_capacity = segment_capacity_;
+      out.write(reinterpret_cast<const char *>(&mh), sizeof(mh));
+      for (uint32_t i = 0; i < n_segments; ++i) {
+        const uint64_t capacity = segments_[i]->capacity;
+        const uint32_t path_len = segments_[i]->path.size();
+        out.write(reinterpret_cast<const char *>(&capacity), sizeof(capacity));
+        out.write(reinterpret_cast<const char *>(&path_len), sizeof(path_len));
+        out.write(segments_[i]->path.data(), path_len);
+      }
+      if (!out.flush()) {
+        throw std::runtime_error("Failed to write manifest: " + tmp_name);
+      }
+    }
+    durable_rename(tmp_name, file_name_);
+  }
+
+  segment_header *map_segment(uint32_t seg) const {
+    if (seg >= n_segments_.load(std::memory_order_acquire)) {
+      throw std::out_of_range("!?segment index out of range?!");
+    }
+    segment &s = *segments_[seg];
+    segment_header *header = s.header.load(std::memory_order_acquire);
+    if (header)
+      return header;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    header = s.header.load(std::memory_order_relaxed);
+    if (header)
+      return header;
+
+    const std::string path = resolve_path(s.path);
+    int fd = open(path.c_str(), writable_ ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to open segment: " + path);
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), "Failed to stat segment: " + path);
+    }
+    if (size_t(statbuf.st_size) < s.capacity) {
+      close(fd);
+      throw std::runtime_error("Segment file truncated: " + path);
+    }
+    void *mapped_addr = mmap(nullptr, s.capacity, writable_ ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped_addr == MAP_FAILED) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), "Failed to mmap segment: " + path);
+    }
+    header = static_cast<segment_header *>(mapped_addr);
+    if (header->rt_uuid_ != RT::TYPE_UUID || header->index_ != seg || header->capacity_ != s.capacity ||
+        header->occupation_ > s.capacity) {
+      munmap(mapped_addr, s.capacity);
+      close(fd);
+      throw std::runtime_error("Segment does not belong to this store: " + path);
+    }
+    s.fd = fd;
+    s.header.store(header, std::memory_order_release);
+    return header;
+  }
+
+  // caller holds mutex_
+  uint32_t append_segment(const std::string &seg_path, size_t capacity) {
+    const uint32_t seg = n_segments_.load(std::memory_order_relaxed);
+    if (seg >= MAX_SEGMENTS) {
+      throw std::length_error("!?too many segments?!");
+    }
+    if (capacity > OFFSET_MASK) {
+      throw std::length_error("!?segment capacity too large?!");
+    }
+    auto s = std::make_unique<segment>();
+    s->path = seg_path.empty() ? default_segment_path(seg) : seg_path;
+    s->capacity = capacity;
+
+    const std::string path = resolve_path(s->path);
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to create segment: " + path);
+    }
+    if (ftruncate(fd, capacity) == -1) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), "Failed to resize segment: " + path);
+    }
+    void *mapped_addr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped_addr == MAP_FAILED) {
+      close(fd);
+      throw std::system_error(errno, std::system_category(), "Failed to mmap segment: " + path);
+    }
+    segment_header *header = new (mapped_addr) segment_header{RT::TYPE_UUID, seg, 0, capacity, sizeof(segment_header)};
+    s->fd = fd;
+    s->header.store(header, std::memory_order_relaxed);
+
+    segments_.push_back(std::move(s));
+    save_manifest(seg + 1);
+    n_segments_.store(seg + 1, std::memory_order_release);
+    return seg;
+  }
+
+  static void *bump(segment_header *header, size_t size, size_t align) {
+    size_t free_spc = header->capacity_ - header->occupation_;
+    void *ptr = reinterpret_cast<std::byte *>(header) + header->occupation_;
+    if (!std::align(align, size, ptr, free_spc))
+      return nullptr;
+    header->occupation_ = reinterpret_cast<std::byte *>(ptr) + size - reinterpret_cast<std::byte *>(header);
+    return ptr;
+  }
+
+public:
+  // writable ctor
+  SDBMR(const std::string &file_name) : SDBMR(file_name, true) { load_manifest(); }
+
+  ~SDBMR() {
+    const uint32_t n = n_segments_.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < n; ++i) {
+      segment &s = *segments_[i];
+      if (segment_header *header = s.header.load(std::memory_order_acquire)) {
+        munmap(reinterpret_cast<void *>(header), s.capacity);
+      }
+      if (s.fd != -1) {
+        close(s.fd);
+      }
+    }
+  }
+
+  SDBMR(const SDBMR &) = delete;
+  SDBMR(SDBMR &&) = delete;
+  SDBMR &operator=(const SDBMR &) = delete;
+  SDBMR &operator=(SDBMR &&) = delete;
+
+  // readonly ctor
+  static const SDBMR<RT> read(const std::string &file_name) { return SDBMR<RT>(file_name, readonly_tag()); }
+
+  // creation ctor, the root object is created in segment 0
+  template <typename... Args>
+  static SDBMR<RT> create(const std::string &file_name, size_t segment_capacity, Args &&...args) {
+    return SDBMR<RT>(file_name, create_tag(), segment_capacity, std::forward<Args>(args)...);
+  }
+
+private:
+  struct readonly_tag {};
+  struct create_tag {};
+
+  SDBMR(const std::string &file_name, readonly_tag) : SDBMR(file_name, false) { load_manifest(); }
+
+  template <typename... Args>
+  SDBMR(const std::string &file_name, create_tag, size_t segment_capacity, Args &&...args) : SDBMR(file_name, true) {
+    segment_capacity_ = segment_capacity;
+    std::lock_guard<std::mutex> lock(mutex_);
+    segment_header *header = segments_[append_segment("", segment_capacity)]->header.load(std::memory_order_relaxed);
+    void *ptr = bump(header, sizeof(RT), alignof(RT));
+    if (!ptr)
+      throw std::bad_alloc();
+    new (ptr) RT(std::forward<Args>(args)...);
+    root_ = pack(0, reinterpret_cast<std::byte *>(ptr) - reinterpret_cast<std::byte *>(header));
+    save_manifest(1);
+  }
+
+public:
+  bool writable() const { return writable_; }
+  size_t segment_capacity() const { return segment_capacity_; }
+  uint32_t segment_count() const { return n_segments_.load(std::memory_order_acquire); }
+
+  uint32_t mapped_segment_count() const {
+    uint32_t mapped = 0;
+    for (uint32_t i = 0; i < segment_count(); ++i) {
+      if (segments_[i]->header.load(std::memory_order_acquire))
+        ++mapped;
+    }
+    return mapped;
+  }
+
+  // add a segment explicitly, e.g. placed on another disk, subsequent allocations go there
+  uint32_t add_segment(const std::string &seg_path = "", size_t capacity = 0) {
+    if (!writable_) {
+      throw std::logic_error("!?adding segment to a readonly SDBMR?!");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return append_segment(seg_path, capacity ? capacity : segment_capacity_);
+  }
+
+  // allocate from the last segment, a new segment is appended when it's full
+  uint64_t allocate(const size_t size, const size_t align) {
+    if (!writable_) {
+      throw std::logic_error("!?allocating from a readonly SDBMR?!");
+    }
+    map_segment(segment_count() - 1); // segments appended later are mapped already
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t seg = n_segments_.load(std::memory_order_relaxed) - 1;
+    segment_header *header = segments_[seg]->header.load(std::memory_order_relaxed);
+    void *ptr = bump(header, size, align);
+    if (!ptr) {
+      const size_t capacity = std::max(segment_capacity_, sizeof(segment_header) + size + align);
+      seg = append_segment("", capacity);
+      header = segments_[seg]->header.load(std::memory_order_relaxed);
+      ptr = bump(header, size, align);
+      if (!ptr)
+        throw std::bad_alloc();
+    }
+    return pack(seg, reinterpret_cast<std::byte *>(ptr) - reinterpret_cast<std::byte *>(header));
+  }
+
+  template <typename VT, typename... Args>
+    requires RegionSafe<VT>
+  segmented_ptr<VT, RT> create(Args &&...args) {
+    const uint64_t packed = allocate(sizeof(VT), alignof(VT));
+    new (resolve(packed)) VT(std::forward<Args>(args)...);
+    return segmented_ptr<VT, RT>(this, packed);
+  }
+
+  // maps the segment on first touch
+  void *resolve(uint64_t packed) const {
+    if (packed == 0)
+      return nullptr;
+    segment_header *header = map_segment(static_cast<uint32_t>(packed >> OFFSET_BITS));
+    return reinterpret_cast<std::byte *>(header) + (packed & OFFSET_MASK);
+  }
+
+  segmented_ptr<RT, RT> root() { return segmented_ptr<RT, RT>(this, root_); }
+  const segmented_ptr<RT, RT> root() const { return segmented_ptr<RT, RT>(const_cast<SDBMR<RT> *>(this), root_); }
+
+  template <typename VT> segmented_ptr<VT, RT> null() { return segmented_ptr<VT, RT>(this, 0); }
+};
+
+// global pointer to an object in a segmented DBMR, the counterpart of global_ptr for SDBMR
+template <typename VT, typename RT> class segmented_ptr final {
+  template <typename OT, typename RT1> friend class segmented_ptr;
+  template <typename RT1>
+    requires ValidMemRegionRootType<RT1>
+  friend class SDBMR;
+
+public:
+  typedef VT target_type;
+  typedef RT root_type;
+
+private:
+  SDBMR<RT> *store_;
+  uint64_t packed_;
+
+  segmented_ptr(SDBMR<RT> *store, uint64_t packed) : store_(store), packed_(packed) {}
+
+public:
+  ~segmented_ptr() = default;
+  segmented_ptr(const segmented_ptr<VT, RT> &) = default;
+  segmented_ptr(segmented_ptr<VT, RT> &&) = default;
+  segmented_ptr &operator=(const segmented_ptr<VT, RT> &) = default;
+  segmented_ptr &operator=(segmented_ptr<VT, RT> &&) = default;
+
+  uint32_t segment() const { return static_cast<uint32_t>(packed_ >> SDBMR<RT>::OFFSET_BITS); }
+
+  template <typename F> //
+  void clear(segmental_ptr<F> VT::*ptrField) {
+    (get()->*ptrField).packed_ = 0;
+  }
+
+  template <typename F> //
+  segmented_ptr<F, RT> set(segmental_ptr<F> VT::*ptrField, const segmented_ptr<F, RT> &tgt) {
+    if (tgt.store_ != store_) {
+      throw std::logic_error("!?cross store ptr assignment?!");
+    }
+    (get()->*ptrField).packed_ = tgt.packed_;
+    return tgt;
+  }
+
+  template <typename F> //
+  segmented_ptr<F, RT> get(segmental_ptr<F> VT::*ptrField) const {
+    return segmented_ptr<F, RT>(store_, (get()->*ptrField).packed_);
+  }
+
+  VT *get() { return static_cast<VT *>(store_->resolve(packed_)); }
+  const VT *get() const { return static_cast<const VT *>(store_->resolve(packed_)); }
+
+  VT &operator*() { return *get(); }
+  VT *operator->() { return get(); }
+  const VT &operator*() const { return *get(); }
+  const VT *operator->() const { return get(); }
+
+  explicit operator bool() const noexcept { return packed_ != 0; }
+
+  auto operator<=>(const segmented_ptr<VT, RT> &other) const = default;
+};
+
+} // namespace shilos
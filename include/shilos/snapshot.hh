@@ -0,0 +1,61 @@
+
+#pragma once
+
+#include "./dirty_tracker.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+namespace shilos {
+
+//
+// point-in-time image of a dirty tracked range, written to a file by a forked child while the parent keeps mutating
+// the range, like Redis' BGSAVE
+//
+// unlike private memory, a shared file mapping is not copy-on-write across fork(), the child would see the parent's
+// writes, so the copy-on-write is done with the write faults of the dirty_tracker instead: the first write to each
+// page after the snapshot began saves its prior content into a shared preimage, the child takes a page from there
+// once saved, or from the live mapping otherwise, confirming after the copy that the page was not saved meanwhile
+//
+// the parent pays a page copy per page first written during the snapshot, and never waits for the image written
+//
+class fork_snapshot {
+public:
+  // length of the image from the consistent copy of the first page, e.g. the occupation of a region,
+  // called in the child, must be async-signal-safe
+  typedef size_t (*image_length_fn)(const std::byte *first_page);
+
+  fork_snapshot(dirty_tracker &tracker, const std::string &file_name, image_length_fn image_length = nullptr);
+  // waits for the child, reporting failures to std::cerr
+  ~fork_snapshot();
+
+  fork_snapshot(const fork_snapshot &) = delete;
+  fork_snapshot &operator=(const fork_snapshot &) = delete;
+
+  const std::string &file_name() const { return file_name_; }
+  pid_t child_pid() const { return pid_; }
+
+  // whether the child has finished, without waiting
+  bool finished();
+  // wait for the child, throws if it failed to write the image
+  void wait();
+
+private:
+  dirty_tracker &tracker_;
+  std::string file_name_;
+  size_t n_pages_;
+  std::byte *preimage_;
+  std::atomic<uint8_t> *flags_;
+  std::byte *scratch_;
+  pid_t pid_ = -1;
+  int status_ = 0;
+  bool reaped_ = false;
+
+  void reaped(int status);
+  void unmap();
+};
+
+} // namespace shilos
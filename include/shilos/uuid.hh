@@ -1,18 +1,30 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <random>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 
 namespace shilos {
 
+class uuid_generator;
+
 class UUID {
+  friend class uuid_generator;
+
 private:
   uint8_t data_[16];
 
+  struct nil_tag {};
+  constexpr explicit UUID(nil_tag) : data_{} {}
+
   constexpr static void byte_to_hex(std::uint8_t byte, char *output) {
     constexpr std::string_view hex_chars = "0123456789ABCDEF";
     output[0] = hex_chars[byte >> 4];
@@ -30,20 +42,17 @@ private:
   }
 
 public:
-  // Generate a random UUID
-  UUID() {
-    std::random_device rd;
-    std::mt19937_64 gen(rd());
-    std::uniform_int_distribution<uint8_t> dist(0, 255);
-    for (auto &byte : data_) {
-      byte = dist(gen);
-    }
-    // Adjust UUID fields according to RFC 4122:
-    // - Set version to 4 (random UUID)
-    data_[6] = (data_[6] & 0x0F) | 0x40;
-    // - Set variant to 2 (RFC 4122 variant)
-    data_[8] = (data_[8] & 0x3F) | 0x80;
-  }
+  // Generate a random (version 4) UUID, see uuid_generator
+  UUID();
+
+  // The all-zero UUID, e.g. to size buffers for uuid_generator::generate() without generating twice
+  static constexpr UUID nil() { return UUID(nil_tag{}); }
+
+  // Raw byte i (0-15), in text order
+  constexpr uint8_t byte(size_t i) const { return data_[i]; }
+
+  // Version field, 4 for random and 7 for time-ordered UUIDs
+  constexpr unsigned version() const { return data_[6] >> 4; }
 
   // Construct from string
   constexpr UUID(const std::string &str) {
@@ -77,8 +86,136 @@ public:
   }
 
   auto operator<=>(const UUID &other) const = default;
+
+  // wyhash-style mix of the two halves, stable across processes and builds (no seed), so usable in region-resident
+  // hash tables, and spreading the timestamp bits of version 7 UUIDs
+  uint64_t hash() const noexcept {
+    uint64_t a, b;
+    std::memcpy(&a, data_, 8);
+    std::memcpy(&b, data_ + 8, 8);
+    const unsigned __int128 m = (unsigned __int128)(a ^ 0xa0761d6478bd642fULL) * (b ^ 0xe7037ed1a0b428dbULL);
+    return uint64_t(m) ^ uint64_t(m >> 64);
+  }
 };
 
+// Bumped in the child on fork, so per-thread generator states inherited from the parent get reseeded
+extern std::atomic<uint64_t> uuid_fork_generation;
+
+//
+// Fast UUID generation, with a per-thread xoshiro256** state seeded once from std::random_device, instead of a
+// random_device and a fresh mt19937_64 per UUID
+//
+// NOTE: xoshiro is not a cryptographic generator, UUIDs are object identities here, not secrets
+//
+class uuid_generator {
+  friend class UUID;
+
+  uint64_t s_[4];
+  uint64_t generation_;
+  uint64_t last_ms_; // timestamp of the last version 7 UUID
+  uint32_t counter_; // sub-millisecond counter of version 7 UUIDs, in the rand_a field
+
+  uuid_generator() { reseed(); }
+
+  void reseed(); // in uuid.cc
+
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  static void store_be48(uint8_t *out, uint64_t v) {
+    for (int i = 5; i >= 0; --i, v >>= 8)
+      out[i] = uint8_t(v);
+  }
+
+  void fill_v4(UUID &u) {
+    const uint64_t a = next(), b = next();
+    std::memcpy(u.data_, &a, 8);
+    std::memcpy(u.data_ + 8, &b, 8);
+    // Set version to 4 (random UUID) and variant to 2 (RFC 4122 variant)
+    u.data_[6] = (u.data_[6] & 0x0F) | 0x40;
+    u.data_[8] = (u.data_[8] & 0x3F) | 0x80;
+  }
+
+  void fill_v7(UUID &u, uint64_t now_ms) {
+    // Monotonic per thread, a 12 bit counter (starting at a random value in its lower half) orders UUIDs minted in
+    // the same millisecond, on its overflow the timestamp is advanced ahead of the clock (as RFC 9562 allows)
+    if (now_ms > last_ms_) {
+      last_ms_ = now_ms;
+      counter_ = uint32_t(next() & 0x7FF);
+    } else if (++counter_ > 0xFFF) {
+      ++last_ms_;
+      counter_ = uint32_t(next() & 0x7FF);
+    }
+    const uint64_t b = next();
+    store_be48(u.data_, last_ms_);
+    u.data_[6] = uint8_t(0x70 | (counter_ >> 8));
+    u.data_[7] = uint8_t(counter_);
+    std::memcpy(u.data_ + 8, &b, 8);
+    u.data_[8] = (u.data_[8] & 0x3F) | 0x80;
+  }
+
+  static uint64_t unix_ms() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count());
+  }
+
+public:
+  uuid_generator(const uuid_generator &) = delete;
+  uuid_generator &operator=(const uuid_generator &) = delete;
+
+  // The calling thread's generator
+  static uuid_generator &local() {
+    thread_local uuid_generator gen;
+    if (gen.generation_ != uuid_fork_generation.load(std::memory_order_relaxed)) [[unlikely]]
+      gen.reseed();
+    return gen;
+  }
+
+  // xoshiro256**
+  uint64_t next() {
+    const uint64_t result = rotl(s_[1] * 5, 7) * 9;
+    const uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+    return result;
+  }
+
+  // Random (version 4) UUIDs
+  UUID v4() {
+    UUID u = UUID::nil();
+    fill_v4(u);
+    return u;
+  }
+
+  void generate(std::span<UUID> out) {
+    for (auto &u : out)
+      fill_v4(u);
+  }
+
+  // Time-ordered (version 7) UUIDs, increasing per thread, so newly created ids cluster in ordered indexes
+  UUID v7() {
+    UUID u = UUID::nil();
+    fill_v7(u, unix_ms());
+    return u;
+  }
+
+  void generate_v7(std::span<UUID> out) {
+    const uint64_t now_ms = unix_ms();
+    for (auto &u : out)
+      fill_v7(u, now_ms);
+  }
+};
+
+inline UUID::UUID() { uuid_generator::local().fill_v4(*this); }
+
 } // namespace shilos
 
+template <> struct std::hash<shilos::UUID> {
+  size_t operator()(const shilos::UUID &uuid) const noexcept { return size_t(uuid.hash()); }
+};
+
 inline std::ostream &operator<<(std::ostream &os, const shilos::UUID &uuid) { return os << uuid.to_string(); }
@@ -0,0 +1,231 @@
+
+#pragma once
+
+#include "./region.hh"
+#include "./uuid.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace shilos {
+
+//
+// region-resident identity table, resolving UUIDs to objects in the same region, e.g. cross-references by id from
+// other projects and external tools, instead of walking the graph
+//
+// the layout is a Swiss table specialized for 16-byte keys: groups of 16 control bytes, each holding a 7-bit
+// fingerprint of the key hash in its slot (or marking it empty/deleted), probed group-wise, a lookup compares the
+// fingerprints of a whole group at once, and only candidate slots have their keys compared, as a single 16-byte vector
+// compare, keys and values are kept in separate arrays, so a probe touches 16 control bytes and few keys
+//
+// the table header is a region-safe value (e.g. a field of the root), its arrays are allocated from the region, and
+// regrown there at 7/8 load, leaving the old arrays behind (regions only bump-allocate), reserve() up front avoids that
+//
+// NOTE: like allocation from a region, mutation is single-writer, and readers must not run concurrently with it
+//
+// NOTE: the array and value offsets are bare (OPAQUE_OFFSETS), records holding a directory can't be cloned to another
+//       region, nor bulk migrated, the objects it resolves to aren't followed
+//
+template <typename VT> class uuid_directory {
+  static constexpr size_t GROUP = 16;
+  static constexpr uint8_t EMPTY = 0x80;
+  static constexpr uint8_t DELETED = 0xFE;
+
+  uint64_t ctrl_;     // offset of capacity control bytes
+  uint64_t keys_;     // offset of capacity UUIDs
+  uint64_t values_;   // offset of capacity object offsets
+  uint64_t capacity_; // 0 or a power of 2, >= GROUP
+  uint64_t size_;
+  uint64_t deleted_;
+
+  template <typename T, typename RT> static T *at(const memory_region<RT> *region, uint64_t offset) {
+    return reinterpret_cast<T *>(reinterpret_cast<intptr_t>(region) + offset);
+  }
+
+  static uint8_t h2(uint64_t hash) { return uint8_t(hash & 0x7F); }
+  static uint64_t h1(uint64_t hash) { return hash >> 7; }
+
+  // bit i set for control bytes of the group equal to b
+  static uint32_t match(const uint8_t *group, uint8_t b) {
+#if defined(__SSE2__)
+    const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(char(b)))));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < GROUP; ++i)
+      bits |= uint32_t(group[i] == b) << i;
+    return bits;
+#endif
+  }
+
+  // bit i set for empty or deleted control bytes of the group, the only ones with the high bit set
+  static uint32_t match_free(const uint8_t *group) {
+#if defined(__SSE2__)
+    return uint32_t(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < GROUP; ++i)
+      bits |= uint32_t(group[i] >> 7) << i;
+    return bits;
+#endif
+  }
+
+  static bool key_equal(const UUID *slot, const UUID &key) {
+#if defined(__SSE2__)
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(slot));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&key));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF;
+#else
+    return *slot == key;
+#endif
+  }
+
+  // slot index of key, or capacity_ if absent
+  template <typename RT> uint64_t find_slot(const memory_region<RT> *region, const UUID &key, uint64_t hash) const {
+    if (capacity_ == 0)
+      return capacity_;
+    const uint8_t *ctrl = at<const uint8_t>(region, ctrl_);
+    const UUID *keys = at<const UUID>(region, keys_);
+    const uint64_t group_mask = capacity_ / GROUP - 1;
+    uint64_t g = h1(hash) & group_mask;
+    for (uint64_t step = 1;; ++step) {
+      const uint8_t *group = ctrl + g * GROUP;
+      for (uint32_t m = match(group, h2(hash)); m != 0; m &= m - 1) {
+        const uint64_t i = g * GROUP + std::countr_zero(m);
+        if (key_equal(&keys[i], key))
+          return i;
+      }
+      if (match(group, EMPTY) != 0)
+        return capacity_;
+      if (step > group_mask)
+        return capacity_; // probed every group
+      g = (g + step) & group_mask; // triangular probing visits all groups of a power of 2 count
+    }
+  }
+
+  // a free slot for a key known absent
+  uint64_t free_slot(const uint8_t *ctrl, uint64_t hash) const {
+    const uint64_t group_mask = capacity_ / GROUP - 1;
+    uint64_t g = h1(hash) & group_mask;
+    for (uint64_t step = 1;; ++step) {
+      if (const uint32_t m = match_free(ctrl + g * GROUP))
+        return g * GROUP + std::countr_zero(m);
+      g = (g + step) & group_mask;
+    }
+  }
+
+  template <typename RT> void rehash(memory_region<RT> *region, uint64_t capacity) {
+    const uint64_t old_capacity = capacity_;
+    const uint8_t *old_ctrl = at<const uint8_t>(region, ctrl_);
+    const UUID *old_keys = at<const UUID>(region, keys_);
+    const uint64_t *old_values = at<const uint64_t>(region, values_);
+
+    auto offset_of = [region](void *ptr) {
+      return uint64_t(reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(region));
+    };
+    uint8_t *ctrl = static_cast<uint8_t *>(region->allocate(capacity, GROUP));
+    UUID *keys = static_cast<UUID *>(region->allocate(capacity * sizeof(UUID), alignof(UUID)));
+    uint64_t *values = static_cast<uint64_t *>(region->allocate(capacity * sizeof(uint64_t), alignof(uint64_t)));
+    std::memset(ctrl, EMPTY, capacity);
+
+    ctrl_ = offset_of(ctrl);
+    keys_ = offset_of(keys);
+    values_ = offset_of(values);
+    capacity_ = capacity;
+    deleted_ = 0;
+    for (uint64_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] & 0x80)
+        continue;
+      const uint64_t hash = old_keys[i].hash();
+      const uint64_t j = free_slot(ctrl, hash);
+      ctrl[j] = h2(hash);
+      std::memcpy(static_cast<void *>(&keys[j]), &old_keys[i], sizeof(UUID));
+      values[j] = old_values[i];
+    }
+  }
+
+public:
+  static constexpr bool OPAQUE_OFFSETS = true;
+
+  uuid_directory() : ctrl_(0), keys_(0), values_(0), capacity_(0), size_(0), deleted_(0) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+
+  // make room for n entries without regrowing
+  template <typename RT> void reserve(memory_region<RT> *region, size_t n) {
+    const uint64_t needed = std::bit_ceil(std::max<uint64_t>(GROUP, (n * 8 + 6) / 7));
+    if (needed > capacity_)
+      rehash(region, needed);
+  }
+
+  template <typename RT> global_ptr<VT, RT> find(memory_region<RT> *region, const UUID &key) const {
+    const uint64_t i = find_slot(region, key, key.hash());
+    return global_ptr<VT, RT>::from_offset(region, i == capacity_ ? 0 : at<const uint64_t>(region, values_)[i]);
+  }
+
+  template <typename RT> bool contains(const memory_region<RT> *region, const UUID &key) const {
+    return find_slot(region, key, key.hash()) != capacity_;
+  }
+
+  // map key to obj, replacing an existing mapping, returns whether key was new
+  template <typename RT> bool insert(memory_region<RT> *region, const UUID &key, const global_ptr<VT, RT> &obj) {
+    if (obj.region() != region) {
+      throw std::logic_error("!?cross region uuid directory entry?!");
+    }
+    const uint64_t hash = key.hash();
+    const uint64_t found = find_slot(region, key, hash);
+    if (found != capacity_) {
+      at<uint64_t>(region, values_)[found] = obj.offset();
+      return false;
+    }
+    if (capacity_ == 0 || size_ + deleted_ + 1 > capacity_ / 8 * 7)
+      rehash(region, size_ + 1 > capacity_ / 16 * 7 ? std::max<uint64_t>(GROUP, capacity_ * 2) : capacity_);
+    uint8_t *ctrl = at<uint8_t>(region, ctrl_);
+    const uint64_t i = free_slot(ctrl, hash);
+    if (ctrl[i] == DELETED)
+      --deleted_;
+    ctrl[i] = h2(hash);
+    std::memcpy(static_cast<void *>(&at<UUID>(region, keys_)[i]), &key, sizeof(UUID));
+    at<uint64_t>(region, values_)[i] = obj.offset();
+    ++size_;
+    return true;
+  }
+
+  template <typename RT> bool erase(memory_region<RT> *region, const UUID &key) {
+    const uint64_t i = find_slot(region, key, key.hash());
+    if (i == capacity_)
+      return false;
+    uint8_t *ctrl = at<uint8_t>(region, ctrl_);
+    // a group with an empty slot never had a probe pass it, so the slot can go back to empty
+    if (match(ctrl + (i & ~uint64_t(GROUP - 1)), EMPTY) != 0) {
+      ctrl[i] = EMPTY;
+    } else {
+      ctrl[i] = DELETED;
+      ++deleted_;
+    }
+    --size_;
+    return true;
+  }
+
+  // call f(const UUID &, global_ptr<VT, RT>) for each entry
+  template <typename RT, typename F> void for_each(memory_region<RT> *region, F &&f) const {
+    const uint8_t *ctrl = at<const uint8_t>(region, ctrl_);
+    const UUID *keys = at<const UUID>(region, keys_);
+    const uint64_t *values = at<const uint64_t>(region, values_);
+    for (uint64_t i = 0; i < capacity_; ++i)
+      if (!(ctrl[i] & 0x80))
+        f(keys[i], global_ptr<VT, RT>::from_offset(region, values[i]));
+  }
+};
+
+} // namespace shilos
@@ -0,0 +1,53 @@
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+#include "./uuid.hh"
+
+namespace shilos {
+
+//
+// bulk conversion of UUIDs from/to their 36 character text form, e.g. importing/exporting textual project files with
+// millions of object ids, vectorized with SSSE3 on x86-64 (picked at runtime) and scalar elsewhere
+//
+// unlike UUID(const std::string &), parsing never throws, errors are reported with where they were found, hex digits
+// are accepted in either case, formatting produces upper case as UUID::to_string() does
+//
+
+enum class uuid_errc {
+  ok,
+  too_short, // the text ends before the UUID does
+  bad_hyphen,
+  bad_hex,
+};
+
+const char *to_string(uuid_errc ec);
+
+struct uuid_parse_result {
+  uuid_errc ec;
+  size_t index; // of the first UUID failing to parse, or of the UUID count parsed when ok
+
+  explicit operator bool() const noexcept { return ec == uuid_errc::ok; }
+};
+
+// parse the UUID at the start of text (extra characters are ignored)
+uuid_errc parse_uuid(std::string_view text, UUID &out) noexcept;
+
+// parse out.size() UUIDs laid out every stride characters (>= 36, e.g. 37 for one per line, with the separators not
+// checked), stops at the first error, with out filled up to the failing UUID
+uuid_parse_result parse_uuids(std::string_view text, std::span<UUID> out, size_t stride = 37) noexcept;
+
+// format to 36 characters, no terminating null
+void format_uuid(const UUID &uuid, char *out) noexcept;
+
+// format in.size() UUIDs every stride characters (>= 36), with the stride - 36 characters between them (and after the
+// last one) filled with separator, the buffer must hold in.size() * stride characters
+void format_uuids(std::span<const UUID> in, char *out, size_t stride = 37, char separator = '\n') noexcept;
+
+// name of the implementation parse/format dispatch to
+const char *uuid_text_impl();
+
+} // namespace shilos
@@ -0,0 +1,45 @@
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+#include "shilos.hh"
+
+using namespace shilos;
+
+static int usage() {
+  std::cerr << "rdelta ships a new version of a region file (cod.project e.g.) as a delta against an old version\n"
+               "\n"
+               "  rdelta sign <old-file> <signature-file>\n"
+               "  rdelta diff <signature-file> <new-file> <delta-file>\n"
+               "  rdelta patch <old-file> <delta-file> [<out-file>]   (patches old-file in place without out-file)\n"
+            << std::endl;
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    return usage();
+  const char *cmd = argv[1];
+
+  try {
+    if (std::strcmp(cmd, "sign") == 0 && argc == 4) {
+      const auto sig = region_delta::sign(argv[2]);
+      region_delta::save_signature(sig, argv[3]);
+      std::cout << sig.block_hashes.size() << " blocks signed" << std::endl;
+    } else if (std::strcmp(cmd, "diff") == 0 && argc == 5) {
+      const auto st = region_delta::diff(region_delta::load_signature(argv[2]), argv[3], argv[4]);
+      std::cout << st.changed_blocks << " blocks changed in " << st.runs << " runs, " << st.literal_bytes
+                << " bytes in delta" << std::endl;
+    } else if (std::strcmp(cmd, "patch") == 0 && (argc == 4 || argc == 5)) {
+      const auto st = region_delta::patch(argv[2], argv[3], argc == 5 ? argv[4] : argv[2]);
+      std::cout << st.changed_blocks << " blocks patched in " << st.runs << " runs" << std::endl;
+    } else {
+      return usage();
+    }
+  } catch (const std::exception &exc) {
+    std::cerr << "rdelta: " << exc.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
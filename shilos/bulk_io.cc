@@ -0,0 +1,645 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+#include "shilos/bulk_io.hh"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define SHILOS_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/fs.h>)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace shilos {
+
+namespace {
+
+constexpr size_t STAGING_ALIGN = 4096;
+
+struct staging_buffers {
+  std::byte *mem = nullptr;
+  size_t chunk_size;
+  unsigned count;
+
+  staging_buffers(size_t chunk_size, unsigned count) : chunk_size(chunk_size), count(count) {
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, STAGING_ALIGN, chunk_size * count) != 0)
+      throw std::bad_alloc();
+    mem = static_cast<std::byte *>(ptr);
+  }
+  ~staging_buffers() { free(mem); }
+
+  staging_buffers(const staging_buffers &) = delete;
+  staging_buffers &operator=(const staging_buffers &) = delete;
+
+  std::byte *at(unsigned i) const { return mem + i * chunk_size; }
+};
+
+size_t round_up(size_t n, size_t unit) { return (n + unit - 1) / unit * unit; }
+
+bool aligned(const void *ptr, size_t n) {
+  return reinterpret_cast<uintptr_t>(ptr) % STAGING_ALIGN == 0 && n % STAGING_ALIGN == 0;
+}
+
+void check_options(const bulk_io::options &opts) {
+  if (opts.chunk_size == 0 || opts.queue_depth == 0) {
+    throw std::invalid_argument("!?bulk io with zero chunk size or queue depth?!");
+  }
+  if (opts.direct && opts.chunk_size % STAGING_ALIGN != 0) {
+    throw std::invalid_argument("!?direct bulk io with unaligned chunk size?!");
+  }
+}
+
+void check_offset(const bulk_io::options &opts, off_t offset) {
+  if (opts.direct && offset % STAGING_ALIGN != 0) {
+    throw std::invalid_argument("!?direct bulk io at an unaligned offset?!");
+  }
+}
+
+// open dst_file to write a copy of the file of src_stat into, created with the same mode, refusing the source file
+// itself (by another path, a hard link, or a symlink to it e.g.), which truncating would destroy
+int open_copy_destination(const struct stat &src_stat, const std::string &dst_file, const bulk_io::options &opts) {
+  int dst_fd = bulk_io::open_file(dst_file, O_CREAT | O_WRONLY, opts, src_stat.st_mode & 07777);
+  struct stat dst_stat;
+  if (fstat(dst_fd, &dst_stat) == -1) {
+    const int err = errno;
+    close(dst_fd);
+    throw std::system_error(err, std::system_category(), "Failed to stat file: " + dst_file);
+  }
+  if (dst_stat.st_dev == src_stat.st_dev && dst_stat.st_ino == src_stat.st_ino) {
+    close(dst_fd);
+    throw std::invalid_argument("!?copying a file onto itself: " + dst_file + "?!");
+  }
+  if (ftruncate(dst_fd, 0) == -1) {
+    const int err = errno;
+    close(dst_fd);
+    throw std::system_error(err, std::system_category(), "Failed to truncate file: " + dst_file);
+  }
+  return dst_fd;
+}
+
+enum class transfer_kind { read, write, copy };
+
+// a chunk of a transfer, in flight
+struct chunk {
+  size_t pos;     // position of the chunk within the transfer
+  size_t need;    // bytes of the chunk
+  size_t done;    // bytes transferred so far, of the current phase
+  std::byte *buf; // the caller's memory, or a staging buffer
+  int buf_index;  // of the staging buffer, -1 for the caller's memory
+  bool writing;   // copies read a chunk, then write it
+};
+
+// direct io transfers whole blocks, the padding beyond need is ignored for reads, and trimmed after writes
+size_t io_length(const chunk &c, bool direct) {
+  return direct ? round_up(c.need - c.done, STAGING_ALIGN) : c.need - c.done;
+}
+
+// account a transfer of res > 0 bytes into c, false when it made no progress, a short direct io transfer is cut back
+// to a block boundary, so the remainder is resubmitted with an aligned offset and buffer, as direct io requires
+bool advance(chunk &c, size_t res, bool direct) {
+  size_t done = c.done + res;
+  if (direct && done < c.need)
+    done = done / STAGING_ALIGN * STAGING_ALIGN;
+  if (done <= c.done)
+    return false;
+  c.done = done;
+  return true;
+}
+
+std::exception_ptr chunk_failure(int err, bool is_write) {
+  if (err != 0)
+    return std::make_exception_ptr(
+        std::system_error(err, std::system_category(), is_write ? "bulk write failed" : "bulk read failed"));
+  if (is_write)
+    return std::make_exception_ptr(std::system_error(EIO, std::system_category(), "bulk write made no progress"));
+  return std::make_exception_ptr(std::system_error(0, std::system_category(), "premature EOF in bulk read"));
+}
+
+// a direct copy writes whole blocks, zero the padding after what was read
+void pad_block(const chunk &c, bool direct) {
+  if (direct)
+    std::memset(c.buf + c.need, 0, round_up(c.need, STAGING_ALIGN) - c.need);
+}
+
+#ifdef SHILOS_HAVE_IO_URING
+
+// a minimal io_uring, driven by raw syscalls, no liburing dependency
+class uring {
+  int fd_ = -1;
+  unsigned entries_ = 0;
+
+  void *sq_ptr_ = MAP_FAILED, *cq_ptr_ = MAP_FAILED, *sqes_ptr_ = MAP_FAILED;
+  size_t sq_size_ = 0, cq_size_ = 0, sqes_size_ = 0;
+
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  io_uring_sqe *sqes_;
+  io_uring_cqe *cqes_;
+
+  unsigned to_submit_ = 0;
+  bool fixed_buffers_ = false;
+
+public:
+  explicit uring(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      fd_ = -1;
+      return;
+    }
+    entries_ = params.sq_entries;
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    sqes_ptr_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes_ptr_ == MAP_FAILED) {
+      teardown();
+      return;
+    }
+
+    auto *sq = static_cast<std::byte *>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto *cq = static_cast<std::byte *>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    sqes_ = static_cast<io_uring_sqe *>(sqes_ptr_);
+  }
+
+  ~uring() { teardown(); }
+
+  uring(const uring &) = delete;
+  uring &operator=(const uring &) = delete;
+
+  explicit operator bool() const { return fd_ != -1; }
+  unsigned entries() const { return entries_; }
+
+  void teardown() {
+    if (sq_ptr_ != MAP_FAILED)
+      munmap(sq_ptr_, sq_size_);
+    if (cq_ptr_ != MAP_FAILED)
+      munmap(cq_ptr_, cq_size_);
+    if (sqes_ptr_ != MAP_FAILED)
+      munmap(sqes_ptr_, sqes_size_);
+    sq_ptr_ = cq_ptr_ = sqes_ptr_ = MAP_FAILED;
+    if (fd_ != -1)
+      close(fd_);
+    fd_ = -1;
+  }
+
+  // pin the staging buffers, so the kernel needn't map them per request, may fail under RLIMIT_MEMLOCK
+  void register_buffers(const staging_buffers &bufs) {
+    std::vector<iovec> iovs(bufs.count);
+    for (unsigned i = 0; i < bufs.count; ++i)
+      iovs[i] = iovec{bufs.at(i), bufs.chunk_size};
+    fixed_buffers_ = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iovs.data(), bufs.count) == 0;
+  }
+
+  // buf_index of a registered buffer, or -1 for any other memory
+  void prep(bool is_write, int fd, void *buf, unsigned len, off_t offset, int buf_index, uint64_t user_data) {
+    const unsigned tail = *sq_tail_;
+    const unsigned idx = tail & *sq_mask_;
+    io_uring_sqe *sqe = &sqes_[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    if (fixed_buffers_ && buf_index >= 0) {
+      sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->buf_index = buf_index;
+    } else {
+      sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    sq_array_[idx] = idx;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+  }
+
+  // submit prepared sqes and wait for at least one completion, 0 or the errno of io_uring_enter, sqes it didn't take
+  // stay prepared, for the next call
+  int submit_and_wait() {
+    for (;;) {
+      const int rc = syscall(__NR_io_uring_enter, fd_, to_submit_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (rc >= 0) {
+        to_submit_ -= rc;
+        return 0;
+      }
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EBUSY) { // out of resources for now, or completions to reap first
+        std::this_thread::yield();
+        return 0;
+      }
+      return errno;
+    }
+  }
+
+  template <typename F> void reap(F &&on_completion) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+      const uint64_t user_data = cqe.user_data;
+      const int res = cqe.res;
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      on_completion(user_data, res);
+    }
+  }
+};
+
+#endif // SHILOS_HAVE_IO_URING
+
+} // namespace
+
+struct bulk_io_session::impl {
+  bulk_io_options opts;
+#ifdef SHILOS_HAVE_IO_URING
+  std::unique_ptr<uring> ring;
+  unsigned depth = 0;
+  // one per queue slot, allocated and registered with the ring on first use
+  std::unique_ptr<staging_buffers> staging;
+
+  std::byte *staging_at(unsigned slot) {
+    if (!staging) {
+      staging = std::make_unique<staging_buffers>(opts.chunk_size, depth);
+      ring->register_buffers(*staging);
+    }
+    return staging->at(slot);
+  }
+
+  void ring_transfer(transfer_kind kind, int src_fd, int dst_fd, std::byte *mem, size_t len, off_t offset);
+#endif
+
+  void threaded_transfer(transfer_kind kind, int src_fd, int dst_fd, std::byte *mem, size_t len, off_t offset);
+
+  void transfer(transfer_kind kind, int src_fd, int dst_fd, std::byte *mem, size_t len, off_t offset) {
+    check_offset(opts, offset);
+    if (len == 0)
+      return;
+#ifdef SHILOS_HAVE_IO_URING
+    if (ring) {
+      ring_transfer(kind, src_fd, dst_fd, mem, len, offset);
+      return;
+    }
+#endif
+    threaded_transfer(kind, src_fd, dst_fd, mem, len, offset);
+  }
+};
+
+#ifdef SHILOS_HAVE_IO_URING
+
+// chunks are submitted in order, up to depth of them in flight, each straight from/to the caller's memory, but for
+// direct io of unaligned memory (and copies), through a staging buffer of its queue slot, short transfers get
+// resubmitted for the remainder, copies write each chunk as soon as it's read
+//
+// once submitted, the kernel owns the buffers until their completions are reaped, so on failures no more chunks are
+// submitted, but the ones in flight are still waited for, before the failure is thrown
+void bulk_io_session::impl::ring_transfer(transfer_kind kind, int src_fd, int dst_fd, std::byte *mem, size_t len,
+                                          off_t offset) {
+  const bool direct = opts.direct;
+  std::vector<chunk> slots(depth);
+  std::vector<unsigned> free_slots;
+  for (unsigned i = depth; i-- > 0;)
+    free_slots.push_back(i);
+
+  auto submit = [&](unsigned slot) {
+    chunk &c = slots[slot];
+    const bool is_write = kind == transfer_kind::write || c.writing;
+    ring->prep(is_write, is_write ? dst_fd : src_fd, c.buf + c.done, io_length(c, direct), offset + c.pos + c.done,
+               c.buf_index, slot);
+  };
+
+  size_t next_pos = 0;
+  unsigned n_inflight = 0;
+  std::exception_ptr failure;
+  bool enter_failed = false;
+  while (n_inflight > 0 || (!failure && next_pos < len)) {
+    while (!failure && next_pos < len && !free_slots.empty()) {
+      const unsigned slot = free_slots.back();
+      free_slots.pop_back();
+      const size_t need = std::min(opts.chunk_size, len - next_pos);
+      chunk &c = slots[slot];
+      c = chunk{next_pos, need, 0, mem + next_pos, -1, false};
+      if (kind == transfer_kind::copy || (direct && !aligned(c.buf, need))) {
+        c.buf = staging_at(slot);
+        c.buf_index = int(slot);
+        if (kind == transfer_kind::write) {
+          std::memcpy(c.buf, mem + next_pos, need);
+          pad_block(c, direct);
+        }
+      }
+      submit(slot);
+      next_pos += need;
+      ++n_inflight;
+    }
+
+    if (const int err = ring->submit_and_wait(); err != 0) {
+      if (enter_failed) { // can't even wait for the chunks in flight, whose buffers are about to be freed
+        std::cerr << "*** Failed to drain io_uring: " << std::strerror(err) << std::endl;
+        std::abort();
+      }
+      enter_failed = true;
+      if (!failure)
+        failure = std::make_exception_ptr(std::system_error(err, std::system_category(), "io_uring_enter failed"));
+      continue;
+    }
+    enter_failed = false;
+
+    ring->reap([&](uint64_t user_data, int res) {
+      const unsigned slot = static_cast<unsigned>(user_data);
+      chunk &c = slots[slot];
+      const bool is_write = kind == transfer_kind::write || c.writing;
+      if (res <= 0 || !advance(c, res, direct)) {
+        if (!failure)
+          failure = chunk_failure(-res, is_write);
+        --n_inflight;
+        return;
+      }
+      if (c.done < c.need) {
+        if (!failure) {
+          submit(slot); // short transfer
+          return;
+        }
+      } else if (kind == transfer_kind::copy && !c.writing && !failure) {
+        pad_block(c, direct);
+        c.writing = true;
+        c.done = 0;
+        submit(slot);
+        return;
+      } else if (kind == transfer_kind::read && c.buf_index >= 0) {
+        std::memcpy(mem + c.pos, c.buf, c.need);
+      }
+      free_slots.push_back(slot);
+      --n_inflight;
+    });
+  }
+  if (failure)
+    std::rethrow_exception(failure);
+}
+
+#endif // SHILOS_HAVE_IO_URING
+
+// a pool of threads taking chunks in turn, each doing plain pread/pwrite, copies pread a chunk then pwrite it
+void bulk_io_session::impl::threaded_transfer(transfer_kind kind, int src_fd, int dst_fd, std::byte *mem, size_t len,
+                                              off_t offset) {
+  const bool direct = opts.direct;
+  const size_t n_chunks = (len + opts.chunk_size - 1) / opts.chunk_size;
+  const unsigned n_threads = std::max(1u, std::min<unsigned>(opts.fallback_threads, n_chunks));
+  std::atomic<size_t> next_chunk{0};
+  std::atomic<bool> failed{false};
+  std::vector<std::exception_ptr> failures(n_threads);
+
+  auto run = [&](chunk &c, bool is_write) {
+    const int fd = is_write ? dst_fd : src_fd;
+    for (c.done = 0; c.done < c.need;) {
+      const ssize_t rc = is_write ? pwrite(fd, c.buf + c.done, io_length(c, direct), offset + c.pos + c.done)
+                                  : pread(fd, c.buf + c.done, io_length(c, direct), offset + c.pos + c.done);
+      if (rc < 0 && errno == EINTR)
+        continue;
+      if (rc <= 0 || !advance(c, rc, direct))
+        std::rethrow_exception(chunk_failure(rc < 0 ? errno : 0, is_write));
+    }
+  };
+
+  auto worker = [&](unsigned ti) {
+    // copies and direct io of unaligned memory go through a buffer of the thread's own
+    std::unique_ptr<staging_buffers> staging;
+    try {
+      for (size_t i; !failed.load(std::memory_order_relaxed) &&
+                     (i = next_chunk.fetch_add(1, std::memory_order_relaxed)) < n_chunks;) {
+        const size_t pos = i * opts.chunk_size, need = std::min(opts.chunk_size, len - pos);
+        chunk c{pos, need, 0, mem + pos, -1, false};
+        if (kind == transfer_kind::copy || (direct && !aligned(c.buf, need))) {
+          if (!staging)
+            staging = std::make_unique<staging_buffers>(opts.chunk_size, 1);
+          c.buf = staging->at(0);
+          c.buf_index = 0;
+        }
+        switch (kind) {
+        case transfer_kind::read:
+          run(c, false);
+          if (c.buf_index >= 0)
+            std::memcpy(mem + pos, c.buf, need);
+          break;
+        case transfer_kind::write:
+          if (c.buf_index >= 0) {
+            std::memcpy(c.buf, mem + pos, need);
+            pad_block(c, direct);
+          }
+          run(c, true);
+          break;
+        case transfer_kind::copy:
+          run(c, false);
+          pad_block(c, direct);
+          run(c, true);
+          break;
+        }
+      }
+    } catch (...) {
+      failures[ti] = std::current_exception();
+      failed.store(true, std::memory_order_relaxed);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned ti = 1; ti < n_threads; ++ti)
+    threads.emplace_back(worker, ti);
+  worker(0);
+  for (auto &t : threads)
+    t.join();
+  for (auto &failure : failures)
+    if (failure)
+      std::rethrow_exception(failure);
+}
+
+bulk_io_session::bulk_io_session(const bulk_io_options &opts) : impl_(std::make_unique<impl>()) {
+  check_options(opts);
+  impl_->opts = opts;
+#ifdef SHILOS_HAVE_IO_URING
+  if (opts.use_io_uring) {
+    auto ring = std::make_unique<uring>(opts.queue_depth);
+    if (*ring) {
+      impl_->depth = std::min<unsigned>(opts.queue_depth, ring->entries());
+      impl_->ring = std::move(ring);
+    }
+  }
+#endif
+}
+
+bulk_io_session::~bulk_io_session() = default;
+
+const bulk_io_options &bulk_io_session::options() const { return impl_->opts; }
+
+bool bulk_io_session::uses_io_uring() const {
+#ifdef SHILOS_HAVE_IO_URING
+  return bool(impl_->ring);
+#else
+  return false;
+#endif
+}
+
+void bulk_io_session::read(int fd, void *dst, size_t len, off_t offset) {
+  impl_->transfer(transfer_kind::read, fd, -1, static_cast<std::byte *>(dst), len, offset);
+}
+
+void bulk_io_session::write(int fd, const void *src, size_t len, off_t offset) {
+  impl_->transfer(transfer_kind::write, -1, fd, const_cast<std::byte *>(static_cast<const std::byte *>(src)), len,
+                  offset);
+}
+
+void bulk_io_session::copy(int src_fd, int dst_fd, size_t len) {
+  impl_->transfer(transfer_kind::copy, src_fd, dst_fd, nullptr, len, 0);
+}
+
+bool bulk_io::io_uring_available() {
+#ifdef SHILOS_HAVE_IO_URING
+  static const bool available = bool(uring(1));
+  return available;
+#else
+  return false;
+#endif
+}
+
+void bulk_io::read(int fd, void *dst, size_t len, off_t offset, const options &opts) {
+  bulk_io_session(opts).read(fd, dst, len, offset);
+}
+
+void bulk_io::write(int fd, const void *src, size_t len, off_t offset, const options &opts) {
+  bulk_io_session(opts).write(fd, src, len, offset);
+}
+
+int bulk_io::open_file(const std::string &file_name, int flags, const options &opts, mode_t mode) {
+#ifdef O_DIRECT
+  if (opts.direct)
+    flags |= O_DIRECT;
+#endif
+  int fd = ::open(file_name.c_str(), flags, mode);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to open file: " + file_name);
+  }
+#ifdef __APPLE__
+  if (opts.direct)
+    fcntl(fd, F_NOCACHE, 1);
+#endif
+  return fd;
+}
+
+void bulk_io::copy_file(const std::string &src_file, const std::string &dst_file, const options &opts) {
+  int src_fd = open_file(src_file, O_RDONLY, opts);
+  struct stat statbuf;
+  if (fstat(src_fd, &statbuf) == -1) {
+    const int err = errno;
+    close(src_fd);
+    throw std::system_error(err, std::system_category(), "Failed to stat file: " + src_file);
+  }
+  const size_t file_size = statbuf.st_size;
+  int dst_fd;
+  try {
+    dst_fd = open_copy_destination(statbuf, dst_file, opts);
+  } catch (...) {
+    close(src_fd);
+    throw;
+  }
+
+  try {
+    bulk_io_session(opts).copy(src_fd, dst_fd, file_size);
+    // trims the block padding of direct io
+    if (ftruncate(dst_fd, file_size) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to resize file: " + dst_file);
+    }
+  } catch (...) {
+    close(src_fd);
+    close(dst_fd);
+    throw;
+  }
+  close(src_fd);
+  close(dst_fd);
+}
+
+bulk_io::clone_method bulk_io::clone_file(const std::string &src_file, const std::string &dst_file) {
+  int src_fd = open(src_file.c_str(), O_RDONLY);
+  if (src_fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to open file: " + src_file);
+  }
+  struct stat statbuf;
+  if (fstat(src_fd, &statbuf) == -1) {
+    const int err = errno;
+    close(src_fd);
+    throw std::system_error(err, std::system_category(), "Failed to stat file: " + src_file);
+  }
+  int dst_fd;
+  try {
+    dst_fd = open_copy_destination(statbuf, dst_file, options());
+  } catch (...) {
+    close(src_fd);
+    throw;
+  }
+  auto close_both = [&] {
+    close(src_fd);
+    close(dst_fd);
+  };
+
+#ifdef FICLONE
+  // O(1) on CoW filesystems (btrfs, xfs with reflink, bcachefs ...)
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    close_both();
+    return clone_method::reflink;
+  }
+#endif
+
+#ifdef __linux__
+  // the kernel may still share extents (nfs, cifs server side copy e.g.), or at least avoid user space copying
+  const size_t file_size = statbuf.st_size;
+  size_t copied = 0;
+  while (copied < file_size) {
+    const ssize_t n = copy_file_range(src_fd, nullptr, dst_fd, nullptr, file_size - copied, 0);
+    if (n > 0) {
+      copied += n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == 0 || (copied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)))
+      break; // not supported for this pair of files, stream it instead
+    const int err = errno;
+    close_both();
+    throw std::system_error(err, std::system_category(), "Failed to copy file: " + src_file + " to " + dst_file);
+  }
+  if (copied == file_size) {
+    close_both();
+    return clone_method::copy_file_range;
+  }
+#endif
+
+  close_both();
+  copy_file(src_file, dst_file);
+  return clone_method::streamed;
+}
+
+} // namespace shilos
@@ -0,0 +1,106 @@
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <fcntl.h>
+#include <iostream>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "shilos/change_feed.hh"
+
+namespace shilos {
+
+// between wake ups of a listener being stopped, until it's out of its wait
+static constexpr std::chrono::microseconds STOP_RETRY_INTERVAL(100);
+
+change_listener::change_listener(const uint32_t *word, std::function<uint64_t()> version, uint64_t since)
+    : word_(word), version_(std::move(version)), stop_(false), exited_(false) {
+#ifdef __linux__
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to create eventfd for change listener");
+  }
+  notify_fd_ = event_fd_;
+#else
+  int fds[2];
+  if (pipe(fds) == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to create pipe for change listener");
+  }
+  for (int fd : fds) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  event_fd_ = fds[0];
+  notify_fd_ = fds[1];
+#endif
+  waiter_ = std::thread([this, since] { run(since); });
+}
+
+change_listener::~change_listener() {
+  stop_.store(true, std::memory_order_release);
+  // the listener waits without a timeout, so no idle wake ups, but it may be about to wait on a word value read
+  // before stop_ was set, which a single wake would miss, it's woken again until it's out, waking needs no write
+  // access to the region (nor changing the word a stop could be waited for on)
+  for (;;) {
+    futex_wake(word_, INT_MAX);
+    if (exited_.load(std::memory_order_acquire))
+      break;
+    std::this_thread::sleep_for(STOP_RETRY_INTERVAL);
+  }
+  waiter_.join();
+  if (notify_fd_ != event_fd_)
+    close(notify_fd_);
+  close(event_fd_);
+}
+
+void change_listener::run(uint64_t since) {
+  std::atomic_ref<uint32_t> word(*const_cast<uint32_t *>(word_));
+  while (!stop_.load(std::memory_order_acquire)) {
+    const uint32_t seq = word.load(std::memory_order_acquire);
+    const uint64_t current = version_();
+    if (current == since) {
+      futex_wait(word_, seq);
+      continue;
+    }
+    since = current;
+#ifdef __linux__
+    const uint64_t one = 1;
+#else
+    const char one = 1;
+#endif
+    // EAGAIN means a notification is pending already, as good
+    if (write(notify_fd_, &one, sizeof(one)) == -1 && errno != EAGAIN && errno != EINTR) {
+      std::cerr << "*** Failed to signal change listener fd: "
+                << std::error_code(errno, std::system_category()).message() << std::endl;
+      break;
+    }
+  }
+  exited_.store(true, std::memory_order_release);
+}
+
+bool change_listener::drain() {
+  bool signaled = false;
+  char buf[8];
+  for (;;) {
+    const ssize_t n = read(event_fd_, buf, sizeof(buf));
+    if (n > 0) {
+      signaled = true;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno != EAGAIN) {
+      throw std::system_error(errno, std::system_category(), "Failed to drain change listener fd");
+    }
+    return signaled;
+  }
+}
+
+} // namespace shilos
@@ -0,0 +1,283 @@
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+#include "shilos/checksum.hh"
+#include "shilos/durability.hh"
+
+namespace shilos {
+
+namespace {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78; // reflected
+
+constexpr std::array<std::array<uint32_t, 256>, 8> make_tables() {
+  std::array<std::array<uint32_t, 256>, 8> tables{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; ++k)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    tables[0][i] = crc;
+  }
+  for (int t = 1; t < 8; ++t)
+    for (uint32_t i = 0; i < 256; ++i)
+      tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+  return tables;
+}
+
+constexpr auto TABLES = make_tables();
+
+uint32_t crc32c_table(uint32_t crc, const std::byte *p, size_t len) {
+  crc = ~crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    v ^= crc; // little endian
+    crc = TABLES[7][v & 0xFF] ^ TABLES[6][(v >> 8) & 0xFF] ^ TABLES[5][(v >> 16) & 0xFF] ^
+          TABLES[4][(v >> 24) & 0xFF] ^ TABLES[3][(v >> 32) & 0xFF] ^ TABLES[2][(v >> 40) & 0xFF] ^
+          TABLES[1][(v >> 48) & 0xFF] ^ TABLES[0][v >> 56];
+  }
+  for (; len > 0; ++p, --len)
+    crc = TABLES[0][(crc ^ uint32_t(*p)) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const std::byte *p, size_t len) {
+  uint64_t c = ~crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+  }
+  uint32_t c32 = uint32_t(c);
+  for (; len > 0; ++p, --len)
+    c32 = _mm_crc32_u8(c32, uint8_t(*p));
+  return ~c32;
+}
+
+bool hw_supported() { return __builtin_cpu_supports("sse4.2"); }
+constexpr const char *HW_IMPL = "sse4.2";
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc"))) uint32_t crc32c_hw(uint32_t crc, const std::byte *p, size_t len) {
+  uint32_t c = ~crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    c = __crc32cd(c, v);
+  }
+  for (; len > 0; ++p, --len)
+    c = __crc32cb(c, uint8_t(*p));
+  return ~c;
+}
+
+#if defined(__linux__)
+bool hw_supported() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+#else
+bool hw_supported() { return true; } // all Apple silicon has it
+#endif
+constexpr const char *HW_IMPL = "armv8-crc";
+
+#else
+
+uint32_t crc32c_hw(uint32_t crc, const std::byte *p, size_t len) { return crc32c_table(crc, p, len); }
+bool hw_supported() { return false; }
+constexpr const char *HW_IMPL = "table";
+
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const std::byte *, size_t);
+
+crc32c_fn selected_crc32c() {
+  static const crc32c_fn fn = hw_supported() ? crc32c_hw : crc32c_table;
+  return fn;
+}
+
+constexpr char SIDECAR_MAGIC[16] = "SHILOS-CRC32C01";
+
+// run fn(i) for i in [0, n) over threads
+template <typename F> void parallel_for(size_t n, unsigned threads, F &&fn) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  constexpr size_t MIN_PER_THREAD = 64;
+  const size_t n_threads = std::clamp<size_t>(n / MIN_PER_THREAD, 1, threads);
+  auto work = [&](size_t ti) {
+    for (size_t i = n * ti / n_threads, last = n * (ti + 1) / n_threads; i < last; ++i)
+      fn(i);
+  };
+  std::vector<std::thread> pool;
+  for (size_t ti = 1; ti < n_threads; ++ti)
+    pool.emplace_back(work, ti);
+  work(0);
+  for (auto &t : pool)
+    t.join();
+}
+
+} // namespace
+
+uint32_t crc32c(const void *data, size_t len, uint32_t crc) {
+  return selected_crc32c()(crc, static_cast<const std::byte *>(data), len);
+}
+
+const char *crc32c_impl() { return selected_crc32c() == crc32c_table ? "table" : HW_IMPL; }
+
+chunk_checksums::chunk_checksums(size_t chunk_size) : chunk_size_(chunk_size) {
+  if (chunk_size == 0) {
+    throw std::invalid_argument("!?checksums of zero sized chunks?!");
+  }
+}
+
+size_t chunk_checksums::length() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return length_;
+}
+
+uint32_t chunk_checksums::chunk_crc(const std::byte *base, size_t chunk) const {
+  const size_t begin = chunk * chunk_size_;
+  return crc32c(base + begin, std::min(chunk_size_, length_ - begin));
+}
+
+void chunk_checksums::reset_verified() {
+  const size_t n_words = (crcs_.size() + 63) / 64;
+  verified_.reset(new std::atomic<uint64_t>[n_words]);
+  for (size_t i = 0; i < n_words; ++i)
+    verified_[i].store(0, std::memory_order_relaxed);
+}
+
+void chunk_checksums::compute(const std::byte *base, size_t length, unsigned threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  length_ = length;
+  crcs_.assign((length + chunk_size_ - 1) / chunk_size_, 0);
+  parallel_for(crcs_.size(), threads, [&](size_t i) { crcs_[i] = chunk_crc(base, i); });
+  reset_verified();
+}
+
+void chunk_checksums::update(const std::byte *base, size_t length, const std::vector<range> &ranges) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t prev_chunks = crcs_.size();
+  // the last chunk was partial, or is now
+  const size_t first_grown = length_ == length ? prev_chunks : std::min(length_, length) / chunk_size_;
+  length_ = length;
+  crcs_.resize((length + chunk_size_ - 1) / chunk_size_);
+  for (size_t i = first_grown; i < crcs_.size(); ++i)
+    crcs_[i] = chunk_crc(base, i);
+  for (const auto &[begin, end] : ranges) {
+    for (size_t i = begin / chunk_size_; i < std::min(first_grown, (end + chunk_size_ - 1) / chunk_size_); ++i)
+      crcs_[i] = chunk_crc(base, i);
+  }
+  if (crcs_.size() != prev_chunks)
+    reset_verified();
+}
+
+void chunk_checksums::zeroed(const std::byte *base, size_t begin, size_t end) {
+  static constexpr std::byte ZEROS[4096] = {};
+  std::lock_guard<std::mutex> lock(mutex_);
+  end = std::min(end, length_);
+  uint32_t zero_crc = 0; // of a whole chunk of zeros, computed on first need
+  bool have_zero_crc = false;
+  for (size_t i = begin / chunk_size_; i * chunk_size_ < end; ++i) {
+    const size_t chunk_begin = i * chunk_size_, chunk_end = std::min(chunk_begin + chunk_size_, length_);
+    if (chunk_begin < begin || chunk_end > end || chunk_end - chunk_begin != chunk_size_) {
+      crcs_[i] = chunk_crc(base, i);
+    } else {
+      if (!have_zero_crc) {
+        for (size_t done = 0; done < chunk_size_; done += sizeof(ZEROS))
+          zero_crc = crc32c(ZEROS, std::min(sizeof(ZEROS), chunk_size_ - done), zero_crc);
+        have_zero_crc = true;
+      }
+      crcs_[i] = zero_crc;
+    }
+    verified_[i / 64].fetch_and(~(uint64_t(1) << (i % 64)), std::memory_order_relaxed);
+  }
+}
+
+std::vector<size_t> chunk_checksums::verify(const std::byte *base, unsigned threads) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<uint8_t> bad(crcs_.size());
+  parallel_for(crcs_.size(), threads, [&](size_t i) {
+    bad[i] = chunk_crc(base, i) != crcs_[i];
+    if (!bad[i])
+      verified_[i / 64].fetch_or(uint64_t(1) << (i % 64), std::memory_order_relaxed);
+  });
+  std::vector<size_t> offsets;
+  for (size_t i = 0; i < bad.size(); ++i)
+    if (bad[i])
+      offsets.push_back(i * chunk_size_);
+  return offsets;
+}
+
+bool chunk_checksums::verify_range(const std::byte *base, size_t offset, size_t len) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t end = std::min(offset + len, length_);
+  for (size_t i = offset / chunk_size_; i * chunk_size_ < end; ++i) {
+    const uint64_t bit = uint64_t(1) << (i % 64);
+    if (verified_[i / 64].load(std::memory_order_relaxed) & bit)
+      continue;
+    if (chunk_crc(base, i) != crcs_[i])
+      return false;
+    verified_[i / 64].fetch_or(bit, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+void chunk_checksums::save(const std::string &file_name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const std::string tmp_name = file_name + ".tmp";
+  {
+    std::ofstream out(tmp_name, std::ios::binary | std::ios::trunc);
+    const uint64_t header[3] = {chunk_size_, length_, crcs_.size()};
+    out.write(SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(crcs_.data()), crcs_.size() * sizeof(uint32_t));
+    if (!out.flush()) {
+      throw std::runtime_error("Failed to write checksums: " + tmp_name);
+    }
+  }
+  // durably, a crash right after must find the new sidecar, or else the old one, not an empty file
+  durable_rename(tmp_name, file_name);
+}
+
+bool chunk_checksums::load(const std::string &file_name) {
+  std::ifstream in(file_name, std::ios::binary);
+  if (!in)
+    return false;
+  char magic[sizeof(SIDECAR_MAGIC)];
+  uint64_t header[3];
+  if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, SIDECAR_MAGIC, sizeof(magic)) != 0 ||
+      !in.read(reinterpret_cast<char *>(header), sizeof(header)) || header[0] == 0 ||
+      header[2] != (header[1] + header[0] - 1) / header[0]) {
+    throw std::runtime_error("Bad checksums file: " + file_name);
+  }
+  std::vector<uint32_t> crcs(header[2]);
+  if (!in.read(reinterpret_cast<char *>(crcs.data()), crcs.size() * sizeof(uint32_t))) {
+    throw std::runtime_error("Truncated checksums file: " + file_name);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  chunk_size_ = header[0];
+  length_ = header[1];
+  crcs_ = std::move(crcs);
+  reset_verified();
+  return true;
+}
+
+} // namespace shilos
@@ -0,0 +1,370 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "shilos/bulk_io.hh"
+#include "shilos/delta.hh"
+#include "shilos/durability.hh"
+
+namespace shilos {
+
+namespace {
+
+constexpr char SIGNATURE_MAGIC[16] = "SHILOS-RSIG-02";
+constexpr char DELTA_MAGIC[16] = "SHILOS-RDLT-02";
+
+constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME32_1 = 0x9E3779B1ULL;
+
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+uint64_t fmix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// a readonly mapping of a whole file
+struct mapped_file {
+  int fd = -1;
+  size_t size = 0;
+  const std::byte *data = nullptr;
+
+  explicit mapped_file(const std::string &file_name) {
+    fd = open(file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to open file: " + file_name);
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+      const int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "Failed to stat file: " + file_name);
+    }
+    size = statbuf.st_size;
+    if (size == 0)
+      return;
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+      const int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "Failed to mmap file: " + file_name);
+    }
+    madvise(ptr, size, MADV_SEQUENTIAL);
+    data = static_cast<const std::byte *>(ptr);
+  }
+
+  ~mapped_file() {
+    if (data)
+      munmap(const_cast<std::byte *>(data), size);
+    close(fd);
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+};
+
+// hash the blocks of a mapped file, spread over the cores
+std::vector<uint64_t> hash_blocks(const std::byte *data, size_t size, size_t block_size) {
+  const size_t n_blocks = (size + block_size - 1) / block_size;
+  std::vector<uint64_t> hashes(n_blocks);
+  constexpr size_t MIN_BLOCKS_PER_THREAD = 1024;
+  const size_t n_threads = std::clamp<size_t>(n_blocks / MIN_BLOCKS_PER_THREAD, 1,
+                                              std::max(1u, std::thread::hardware_concurrency()));
+  auto work = [&](size_t ti) {
+    const size_t first = n_blocks * ti / n_threads, last = n_blocks * (ti + 1) / n_threads;
+    for (size_t b = first; b < last; ++b) {
+      const size_t pos = b * block_size;
+      hashes[b] = region_delta::hash_block(data + pos, std::min(block_size, size - pos));
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t ti = 1; ti < n_threads; ++ti)
+    threads.emplace_back(work, ti);
+  work(0);
+  for (auto &t : threads)
+    t.join();
+  return hashes;
+}
+
+void write_all(int fd, const void *buf, size_t len, const std::string &file_name) {
+  const std::byte *p = static_cast<const std::byte *>(buf);
+  while (len > 0) {
+    const ssize_t rc = ::write(fd, p, len);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::system_category(), "Failed to write file: " + file_name);
+    }
+    p += rc;
+    len -= rc;
+  }
+}
+
+void pwrite_all(int fd, const void *buf, size_t len, size_t offset, const std::string &file_name) {
+  const std::byte *p = static_cast<const std::byte *>(buf);
+  while (len > 0) {
+    const ssize_t rc = pwrite(fd, p, len, offset);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::system_category(), "Failed to write file: " + file_name);
+    }
+    p += rc;
+    len -= rc;
+    offset += rc;
+  }
+}
+
+uint64_t read_u64(const mapped_file &file, size_t &pos, const std::string &file_name) {
+  uint64_t v;
+  if (pos + sizeof(v) > file.size) {
+    throw std::runtime_error("Truncated file: " + file_name);
+  }
+  std::memcpy(&v, file.data + pos, sizeof(v));
+  pos += sizeof(v);
+  return v;
+}
+
+void check_magic(const mapped_file &file, const char (&magic)[16], const std::string &file_name) {
+  if (file.size < sizeof(magic) || std::memcmp(file.data, magic, sizeof(magic)) != 0) {
+    throw std::runtime_error("Bad file format: " + file_name);
+  }
+}
+
+} // namespace
+
+uint64_t region_delta::hash_block(const std::byte *data, size_t len, uint64_t seed) {
+  // xxh3 style accumulation, 32x32->64 multiplies the compiler maps onto pmuludq (sse2/avx2) or umull (neon),
+  // each stripe keyed by its position, and the accumulators scrambled every 16 stripes, so a block with its stripes
+  // reordered hashes differently
+  const uint64_t seed_key = fmix64(seed + PRIME64_3);
+  const u64x4 secret0 = u64x4{PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_1 ^ PRIME64_2} ^ seed_key;
+  const u64x4 secret1 =
+      u64x4{PRIME64_3 ^ PRIME64_1, PRIME64_2 ^ PRIME64_3, PRIME64_2, PRIME64_1 + PRIME64_3} - seed_key;
+  u64x4 acc0 = {PRIME64_1, PRIME64_2, PRIME64_3, uint64_t(len)};
+  u64x4 acc1 = {PRIME64_3, PRIME64_1, PRIME64_2, ~uint64_t(len)};
+
+  auto round = [](u64x4 &acc, const u64x4 &v, const u64x4 &secret, uint64_t position_key) {
+    const u64x4 key = v ^ (secret + position_key);
+    acc += __builtin_shufflevector(v, v, 1, 0, 3, 2); // keep the data itself, a lane product alone may be zero
+    acc += (key & 0xFFFFFFFFULL) * (key >> 32);
+  };
+  auto scramble = [](u64x4 &acc, const u64x4 &secret) {
+    acc ^= acc >> 47;
+    acc ^= secret;
+    acc *= PRIME32_1;
+  };
+  auto stripe = [&](const std::byte *p, uint64_t position_key) {
+    u64x4 v0, v1;
+    std::memcpy(&v0, p, sizeof(v0));
+    std::memcpy(&v1, p + 32, sizeof(v1));
+    round(acc0, v0, secret0, position_key);
+    round(acc1, v1, secret1, position_key);
+  };
+
+  size_t pos = 0;
+  uint64_t position_key = seed_key;
+  for (size_t n = 1; pos + 64 <= len; pos += 64, ++n) {
+    stripe(data + pos, position_key);
+    position_key += PRIME64_2;
+    if (n % 16 == 0) {
+      scramble(acc0, secret1);
+      scramble(acc1, secret0);
+    }
+  }
+  if (pos < len) {
+    alignas(32) std::byte tail[64] = {};
+    std::memcpy(tail, data + pos, len - pos);
+    stripe(tail, position_key);
+  }
+
+  uint64_t h = len * PRIME64_1 ^ seed_key;
+  for (int i = 0; i < 4; ++i) {
+    h = fmix64(h ^ acc0[i]) * PRIME64_2;
+    h = fmix64(h ^ acc1[i]) * PRIME64_3;
+  }
+  return fmix64(h);
+}
+
+uint64_t region_delta::hash_content(const std::byte *data, size_t len) { return hash_block(data, len, CONTENT_SEED); }
+
+region_delta::signature region_delta::sign(const std::string &file_name, size_t block_size) {
+  if (block_size == 0 || block_size % 64 != 0) {
+    throw std::invalid_argument("!?delta block size not a multiple of 64?!");
+  }
+  mapped_file file(file_name);
+  signature sig;
+  sig.block_size = block_size;
+  sig.file_size = file.size;
+  sig.block_hashes = hash_blocks(file.data, file.size, block_size);
+  sig.content_hash = hash_content(file.data, file.size);
+  return sig;
+}
+
+void region_delta::save_signature(const signature &sig, const std::string &file_name) {
+  int fd = open(file_name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to create file: " + file_name);
+  }
+  try {
+    const uint64_t header[4] = {sig.block_size, sig.file_size, sig.content_hash, sig.block_hashes.size()};
+    write_all(fd, SIGNATURE_MAGIC, sizeof(SIGNATURE_MAGIC), file_name);
+    write_all(fd, header, sizeof(header), file_name);
+    write_all(fd, sig.block_hashes.data(), sig.block_hashes.size() * sizeof(uint64_t), file_name);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+region_delta::signature region_delta::load_signature(const std::string &file_name) {
+  mapped_file file(file_name);
+  check_magic(file, SIGNATURE_MAGIC, file_name);
+  size_t pos = sizeof(SIGNATURE_MAGIC);
+  signature sig;
+  sig.block_size = read_u64(file, pos, file_name);
+  sig.file_size = read_u64(file, pos, file_name);
+  sig.content_hash = read_u64(file, pos, file_name);
+  const size_t n_blocks = read_u64(file, pos, file_name);
+  if (sig.block_size == 0 || n_blocks != (sig.file_size + sig.block_size - 1) / sig.block_size ||
+      file.size - pos != n_blocks * sizeof(uint64_t)) {
+    throw std::runtime_error("Bad file format: " + file_name);
+  }
+  sig.block_hashes.resize(n_blocks);
+  std::memcpy(sig.block_hashes.data(), file.data + pos, n_blocks * sizeof(uint64_t));
+  return sig;
+}
+
+region_delta::stats region_delta::diff(const signature &old_sig, const std::string &new_file,
+                                       const std::string &delta_file) {
+  const size_t block_size = old_sig.block_size;
+  mapped_file file(new_file);
+  const std::vector<uint64_t> new_hashes = hash_blocks(file.data, file.size, block_size);
+
+  // coalesce changed blocks into runs of [begin, end) offsets
+  std::vector<std::pair<size_t, size_t>> runs;
+  stats st;
+  for (size_t b = 0; b < new_hashes.size(); ++b) {
+    if (b < old_sig.block_hashes.size() && old_sig.block_hashes[b] == new_hashes[b])
+      continue;
+    ++st.changed_blocks;
+    const size_t begin = b * block_size, end = std::min(begin + block_size, file.size);
+    if (!runs.empty() && runs.back().second == begin)
+      runs.back().second = end;
+    else
+      runs.emplace_back(begin, end);
+  }
+  st.runs = runs.size();
+
+  int fd = open(delta_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to create file: " + delta_file);
+  }
+  try {
+    const uint64_t header[6] = {block_size, old_sig.file_size, old_sig.content_hash,
+                                file.size, hash_content(file.data, file.size), runs.size()};
+    write_all(fd, DELTA_MAGIC, sizeof(DELTA_MAGIC), delta_file);
+    write_all(fd, header, sizeof(header), delta_file);
+    for (const auto &[begin, end] : runs) {
+      const uint64_t run[2] = {begin, end - begin};
+      write_all(fd, run, sizeof(run), delta_file);
+      write_all(fd, file.data + begin, end - begin, delta_file);
+      st.literal_bytes += end - begin;
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return st;
+}
+
+region_delta::stats region_delta::patch(const std::string &old_file, const std::string &delta_file,
+                                        const std::string &out_file, bool verify) {
+  mapped_file delta(delta_file);
+  check_magic(delta, DELTA_MAGIC, delta_file);
+  size_t pos = sizeof(DELTA_MAGIC);
+  const size_t block_size = read_u64(delta, pos, delta_file);
+  const size_t old_size = read_u64(delta, pos, delta_file);
+  const uint64_t old_hash = read_u64(delta, pos, delta_file);
+  const size_t new_size = read_u64(delta, pos, delta_file);
+  const uint64_t new_hash = read_u64(delta, pos, delta_file);
+  const size_t n_runs = read_u64(delta, pos, delta_file);
+
+  // the size of the base is always checked, its whole content unless verify is false
+  {
+    mapped_file old(old_file);
+    if (old.size != old_size || (verify && hash_content(old.data, old.size) != old_hash)) {
+      throw std::runtime_error("Delta base mismatch: " + old_file + " is not the version " + delta_file +
+                               " was computed against");
+    }
+  }
+
+  // patched and verified aside, then renamed into place, so a failed patch leaves out_file (old_file e.g.) as it was
+  const std::string tmp_file = out_file + ".tmp";
+  bulk_io::clone_file(old_file, tmp_file);
+  int fd = open(tmp_file.c_str(), O_RDWR);
+  if (fd == -1) {
+    const int err = errno;
+    unlink(tmp_file.c_str());
+    throw std::system_error(err, std::system_category(), "Failed to open file: " + tmp_file);
+  }
+  stats st;
+  try {
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to stat file: " + tmp_file);
+    }
+    if (size_t(statbuf.st_size) != old_size) {
+      throw std::runtime_error("Delta base mismatch: " + old_file + " is not the version " + delta_file +
+                               " was computed against");
+    }
+    if (ftruncate(fd, new_size) == -1) {
+      throw std::system_error(errno, std::system_category(), "Failed to resize file: " + tmp_file);
+    }
+    for (size_t r = 0; r < n_runs; ++r) {
+      const size_t offset = read_u64(delta, pos, delta_file);
+      const size_t length = read_u64(delta, pos, delta_file);
+      if (pos + length > delta.size || offset + length > new_size) {
+        throw std::runtime_error("Bad file format: " + delta_file);
+      }
+      pwrite_all(fd, delta.data + pos, length, offset, tmp_file);
+      pos += length;
+      st.changed_blocks += (length + block_size - 1) / block_size;
+      st.literal_bytes += length;
+    }
+    st.runs = n_runs;
+    close(fd);
+    fd = -1;
+    if (verify) {
+      mapped_file out(tmp_file);
+      if (hash_content(out.data, out.size) != new_hash) {
+        throw std::runtime_error("Delta verification failed: " + out_file);
+      }
+    }
+    durable_rename(tmp_file, out_file); // syncs it first
+  } catch (...) {
+    if (fd != -1)
+      close(fd);
+    unlink(tmp_file.c_str());
+    throw;
+  }
+  return st;
+}
+
+} // namespace shilos
@@ -0,0 +1,332 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "shilos/dirty_tracker.hh"
+
+namespace shilos {
+
+namespace {
+
+constexpr int MAX_TRACKED = 256;
+
+// lock-free registry consulted from the fault handler
+struct tracked_slot {
+  std::atomic<uintptr_t> begin{0};
+  std::atomic<uintptr_t> end{0};
+  std::atomic<std::atomic<uint64_t> *> bitmap{nullptr};
+  // set while a snapshot is being taken
+  std::atomic<std::byte *> preimage{nullptr};
+  std::atomic<std::atomic<uint8_t> *> preimage_flags{nullptr};
+  std::atomic<int> in_handler{0};
+  // serializes marking+unprotecting in the handler against clearing+protecting in flushes
+  std::atomic<bool> locked{false};
+
+  void lock() {
+    while (locked.exchange(true, std::memory_order_acquire))
+      ; // held only across a bitmap update and an mprotect
+  }
+  void unlock() { locked.store(false, std::memory_order_release); }
+};
+
+tracked_slot slots[MAX_TRACKED];
+std::mutex registry_mutex;
+
+struct sigaction prev_segv_action, prev_bus_action;
+bool handler_installed = false;
+
+size_t cached_page_size = 0;
+
+void chain_to_previous(int sig, siginfo_t *info, void *ctx) {
+  const struct sigaction &prev = sig == SIGBUS ? prev_bus_action : prev_segv_action;
+  if (prev.sa_flags & SA_SIGINFO) {
+    if (prev.sa_sigaction) {
+      prev.sa_sigaction(sig, info, ctx);
+      return;
+    }
+  } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+    prev.sa_handler(sig);
+    return;
+  }
+  // restore the default action, the faulting instruction will fault again and terminate the process
+  signal(sig, SIG_DFL);
+}
+
+// with the slot locked, before the page gets writable
+void save_preimage(tracked_slot &slot, uintptr_t begin, size_t page) {
+  std::atomic<uint8_t> *flags = slot.preimage_flags.load(std::memory_order_acquire);
+  if (!flags || flags[page].load(std::memory_order_relaxed))
+    return;
+  std::memcpy(slot.preimage.load(std::memory_order_relaxed) + page * cached_page_size,
+              reinterpret_cast<const void *>(begin + page * cached_page_size), cached_page_size);
+  flags[page].store(1, std::memory_order_release);
+  // pairs with the fence of a snapshot reader between copying a page and checking its flag
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void write_fault_handler(int sig, siginfo_t *info, void *ctx) {
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+  for (auto &slot : slots) {
+    // seq_cst, against the destructor storing begin/end then loading in_handler (store->load needs a full fence)
+    slot.in_handler.fetch_add(1, std::memory_order_seq_cst);
+    const uintptr_t begin = slot.begin.load(std::memory_order_seq_cst);
+    const uintptr_t end = slot.end.load(std::memory_order_seq_cst);
+    if (begin <= addr && addr < end) {
+      std::atomic<uint64_t> *bitmap = slot.bitmap.load(std::memory_order_acquire);
+      const size_t page = (addr - begin) / cached_page_size;
+      slot.lock();
+      save_preimage(slot, begin, page);
+      bitmap[page / 64].fetch_or(uint64_t(1) << (page % 64), std::memory_order_relaxed);
+      const int rc = mprotect(reinterpret_cast<void *>(begin + page * cached_page_size), cached_page_size,
+                              PROT_READ | PROT_WRITE);
+      slot.unlock();
+      slot.in_handler.fetch_sub(1, std::memory_order_release);
+      if (rc != 0)
+        chain_to_previous(sig, info, ctx);
+      return;
+    }
+    slot.in_handler.fetch_sub(1, std::memory_order_release);
+  }
+  chain_to_previous(sig, info, ctx);
+}
+
+void install_handler() {
+  if (handler_installed)
+    return;
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = write_fault_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGSEGV, &sa, &prev_segv_action) == -1 || sigaction(SIGBUS, &sa, &prev_bus_action) == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to install write fault handler");
+  }
+  handler_installed = true;
+}
+
+} // namespace
+
+size_t dirty_tracker::page_size() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+dirty_tracker::dirty_tracker(void *base, size_t size)
+    : base_(static_cast<std::byte *>(base)), size_(size), n_pages_((size + page_size() - 1) / page_size()),
+      bitmap_(new std::atomic<uint64_t>[(n_pages_ + 63) / 64]), slot_(-1) {
+  if (reinterpret_cast<uintptr_t>(base) % page_size() != 0) {
+    throw std::invalid_argument("!?dirty tracking of a range not page aligned?!");
+  }
+  for (size_t i = 0; i < (n_pages_ + 63) / 64; ++i)
+    bitmap_[i].store(0, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  cached_page_size = page_size();
+  install_handler();
+  for (int i = 0; i < MAX_TRACKED; ++i) {
+    if (slots[i].begin.load(std::memory_order_relaxed) == 0) {
+      slot_ = i;
+      break;
+    }
+  }
+  if (slot_ < 0) {
+    throw std::length_error("!?too many dirty tracked ranges?!");
+  }
+  auto &slot = slots[slot_];
+  slot.bitmap.store(bitmap_.get(), std::memory_order_release);
+  slot.end.store(reinterpret_cast<uintptr_t>(base_) + size_, std::memory_order_release);
+  slot.begin.store(reinterpret_cast<uintptr_t>(base_), std::memory_order_release);
+
+  if (mprotect(base_, size_, PROT_READ) == -1) {
+    slot.begin.store(0, std::memory_order_release);
+    slot.end.store(0, std::memory_order_release);
+    throw std::system_error(errno, std::system_category(), "Failed to write protect region");
+  }
+}
+
+dirty_tracker::~dirty_tracker() {
+  stop_flusher();
+  try {
+    flush();
+  } catch (const std::exception &exc) {
+    std::cerr << "*** Failed to flush dirty pages: " << exc.what() << std::endl;
+  }
+
+  // no more faults from our range after this
+  mprotect(base_, size_, PROT_READ | PROT_WRITE);
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  auto &slot = slots[slot_];
+  // seq_cst, pairs with the handler announcing itself before loading begin/end, either it sees the range gone or we
+  // see it in the handler
+  slot.begin.store(0, std::memory_order_seq_cst);
+  slot.end.store(0, std::memory_order_seq_cst);
+  // wait out handlers possibly still looking at our bitmap
+  while (slot.in_handler.load(std::memory_order_seq_cst) > 0)
+    std::this_thread::yield();
+  slot.bitmap.store(nullptr, std::memory_order_release);
+}
+
+size_t dirty_tracker::dirty_pages() const {
+  size_t n = 0;
+  for (size_t i = 0; i < (n_pages_ + 63) / 64; ++i)
+    n += __builtin_popcountll(bitmap_[i].load(std::memory_order_relaxed));
+  return n;
+}
+
+std::vector<dirty_tracker::range> dirty_tracker::take_dirty_ranges() {
+  const size_t psz = page_size();
+  auto &slot = slots[slot_];
+  std::vector<range> ranges;
+  for (size_t w = 0; w < (n_pages_ + 63) / 64; ++w) {
+    if (bitmap_[w].load(std::memory_order_relaxed) == 0)
+      continue;
+    // clear and rearm atomically wrt. the fault handler, a write after this faults and gets marked again,
+    // and one before this is covered by the msync following
+    slot.lock();
+    const uint64_t taken = bitmap_[w].exchange(0, std::memory_order_acq_rel);
+    uint64_t bits = taken;
+    while (bits) {
+      const size_t first = __builtin_ctzll(bits);
+      const uint64_t run = bits >> first;
+      const size_t n = ~run == 0 ? 64 : __builtin_ctzll(~run); // contiguous dirty pages in this word
+      bits = n + first >= 64 ? 0 : bits & ~(((uint64_t(1) << n) - 1) << first);
+      const size_t begin = (w * 64 + first) * psz, end = std::min(begin + n * psz, size_);
+      if (mprotect(base_ + begin, end - begin, PROT_READ) == -1) {
+        const int err = errno;
+        bitmap_[w].fetch_or(taken, std::memory_order_relaxed);
+        slot.unlock();
+        mark_dirty(ranges); // not to be flushed by the caller
+        throw std::system_error(err, std::system_category(), "Failed to write protect region");
+      }
+      if (!ranges.empty() && ranges.back().second == begin)
+        ranges.back().second = end;
+      else
+        ranges.emplace_back(begin, end);
+    }
+    slot.unlock();
+  }
+  return ranges;
+}
+
+size_t dirty_tracker::flush() {
+  std::lock_guard<std::mutex> lock(flush_mutex_);
+  size_t flushed = 0;
+  std::vector<range> ranges = take_dirty_ranges();
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    const auto [begin, end] = ranges[i];
+    if (msync(base_ + begin, end - begin, MS_SYNC) == -1) {
+      const int err = errno;
+      // the pages are clean as far as the bitmap knows, have them flushed by the next round instead of lost
+      mark_dirty(std::vector<range>(ranges.begin() + i, ranges.end()));
+      ranges.resize(i);
+      if (flushed_hook_ && !ranges.empty())
+        flushed_hook_(ranges);
+      throw std::system_error(err, std::system_category(), "Failed to msync region");
+    }
+    flushed += end - begin;
+  }
+  if (flushed_hook_ && !ranges.empty())
+    flushed_hook_(ranges);
+  return flushed;
+}
+
+void dirty_tracker::on_flushed(std::function<void(const std::vector<range> &)> hook) {
+  std::lock_guard<std::mutex> lock(flush_mutex_);
+  flushed_hook_ = std::move(hook);
+}
+
+void dirty_tracker::mark_all_dirty() {
+  auto &slot = slots[slot_];
+  slot.lock();
+  for (size_t page = 0; page < n_pages_; ++page)
+    save_preimage(slot, reinterpret_cast<uintptr_t>(base_), page);
+  for (size_t i = 0; i < (n_pages_ + 63) / 64; ++i)
+    bitmap_[i].store(~uint64_t(0), std::memory_order_relaxed);
+  if (n_pages_ % 64)
+    bitmap_[n_pages_ / 64].store((uint64_t(1) << (n_pages_ % 64)) - 1, std::memory_order_relaxed);
+  const int rc = mprotect(base_, size_, PROT_READ | PROT_WRITE);
+  slot.unlock();
+  if (rc == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to unprotect region");
+  }
+}
+
+void dirty_tracker::mark_dirty(const std::vector<range> &ranges) {
+  const size_t psz = page_size();
+  auto &slot = slots[slot_];
+  slot.lock();
+  for (const auto &[begin, end] : ranges) {
+    for (size_t page = begin / psz; page * psz < end; ++page) {
+      save_preimage(slot, reinterpret_cast<uintptr_t>(base_), page);
+      bitmap_[page / 64].fetch_or(uint64_t(1) << (page % 64), std::memory_order_relaxed);
+    }
+    mprotect(base_ + begin, end - begin, PROT_READ | PROT_WRITE);
+  }
+  slot.unlock();
+}
+
+void dirty_tracker::begin_snapshot(std::byte *preimage, std::atomic<uint8_t> *flags) {
+  auto &slot = slots[slot_];
+  slot.lock();
+  if (slot.preimage_flags.load(std::memory_order_relaxed)) {
+    slot.unlock();
+    throw std::logic_error("!?snapshot of a range already being snapshotted?!");
+  }
+  slot.preimage.store(preimage, std::memory_order_relaxed);
+  slot.preimage_flags.store(flags, std::memory_order_release);
+  // dirty pages are writable, have them fault again, they stay marked dirty
+  const int rc = mprotect(base_, size_, PROT_READ);
+  if (rc == -1) {
+    slot.preimage_flags.store(nullptr, std::memory_order_release);
+  }
+  slot.unlock();
+  if (rc == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to write protect region");
+  }
+}
+
+void dirty_tracker::end_snapshot() {
+  auto &slot = slots[slot_];
+  slot.lock();
+  slot.preimage_flags.store(nullptr, std::memory_order_release);
+  slot.preimage.store(nullptr, std::memory_order_relaxed);
+  slot.unlock();
+}
+
+void dirty_tracker::start_flusher(std::chrono::milliseconds latency_budget) {
+  stop_flusher();
+  flusher_stop_ = false;
+  flusher_ = std::thread([this, latency_budget] {
+    std::unique_lock<std::mutex> lock(flusher_mutex_);
+    while (!flusher_cv_.wait_for(lock, latency_budget, [this] { return flusher_stop_; })) {
+      lock.unlock();
+      try {
+        flush();
+      } catch (const std::exception &) {
+        // keep trying, the next round may well succeed, and the final flush on close reports failures
+      }
+      lock.lock();
+    }
+  });
+}
+
+void dirty_tracker::stop_flusher() {
+  if (!flusher_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(flusher_mutex_);
+    flusher_stop_ = true;
+  }
+  flusher_cv_.notify_all();
+  flusher_.join();
+}
+
+} // namespace shilos
@@ -0,0 +1,201 @@
+
+#include <cerrno>
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+#include "shilos/durability.hh"
+
+namespace shilos {
+
+void durable_rename(const std::string &tmp_name, const std::string &file_name) {
+  int fd = open(tmp_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to open file: " + tmp_name);
+  }
+  if (fsync(fd) == -1) {
+    const int err = errno;
+    close(fd);
+    throw std::system_error(err, std::system_category(), "Failed to fsync file: " + tmp_name);
+  }
+  close(fd);
+  if (rename(tmp_name.c_str(), file_name.c_str()) == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to rename " + tmp_name + " to " + file_name);
+  }
+  const size_t slash = file_name.rfind('/');
+  const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : file_name.substr(0, slash);
+  fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to open directory: " + dir);
+  }
+  if (fsync(fd) == -1) {
+    const int err = errno;
+    close(fd);
+    throw std::system_error(err, std::system_category(), "Failed to fsync directory: " + dir);
+  }
+  close(fd);
+}
+
+durability_service &durability_service::instance() {
+  // never destroyed, the service thread runs for the life of the process
+  static durability_service *service = new durability_service();
+  return *service;
+}
+
+durability_service::durability_service() {
+  thread_ = std::thread([this] { run(); });
+  thread_.detach();
+}
+
+durability_service::target_id durability_service::register_target(std::function<void()> sync) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const target_id target = next_target_++;
+  targets_[target].sync = std::move(sync);
+  return target;
+}
+
+void durability_service::unregister_target(target_id target) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = targets_.find(target);
+  if (it == targets_.end())
+    return;
+  // the commits not yet taken are left to the service thread, to be published by the batch syncing them, never before
+  it->second.failure = nullptr;
+  ++urgent_;
+  work_cv_.notify_one();
+  durable_cv_.wait(lock, [&] { return it->second.pending.empty() && !it->second.syncing; });
+  --urgent_;
+  const std::exception_ptr failure = it->second.failure; // in failed_ too, for the committers to see
+  targets_.erase(it);
+  if (failure)
+    std::rethrow_exception(failure);
+}
+
+durability_service::ticket durability_service::commit(target_id target) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = targets_.find(target);
+  if (it == targets_.end()) {
+    throw std::logic_error("!?commit to an unregistered durability target?!");
+  }
+  if (n_pending_++ == 0)
+    first_pending_ = std::chrono::steady_clock::now();
+  const ticket t = next_ticket_++;
+  it->second.pending.push_back(t);
+  work_cv_.notify_one();
+  return t;
+}
+
+void durability_service::wait_durable(ticket t) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  durable_cv_.wait(lock, [&] { return durable_ >= t; });
+  if (auto it = failed_.find(t); it != failed_.end()) {
+    const std::exception_ptr failure = it->second;
+    failed_.erase(it);
+    std::rethrow_exception(failure);
+  }
+  if (t <= forgotten_) {
+    throw std::runtime_error("Durability unknown, failures not waited for were forgotten, of ticket: " +
+                             std::to_string(t));
+  }
+}
+
+bool durability_service::is_durable(ticket t) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return durable_ >= t && t > forgotten_ && !failed_.contains(t);
+}
+
+void durability_service::set_max_delay(std::chrono::microseconds max_delay) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_delay_ = max_delay;
+  work_cv_.notify_one();
+}
+
+void durability_service::set_max_batch(size_t max_batch) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_batch_ = max_batch ? max_batch : 1;
+  work_cv_.notify_one();
+}
+
+std::chrono::microseconds durability_service::max_delay() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return max_delay_;
+}
+
+size_t durability_service::max_batch() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return max_batch_;
+}
+
+uint64_t durability_service::batches_synced() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return batches_synced_;
+}
+
+uint64_t durability_service::commits_synced() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return commits_synced_;
+}
+
+void durability_service::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  struct batch_entry {
+    target_id target;
+    std::function<void()> sync;
+    std::vector<ticket> tickets;
+  };
+  std::vector<batch_entry> batch;
+  for (;;) {
+    work_cv_.wait(lock, [this] { return n_pending_ > 0; });
+    // give more commits a chance to join this batch
+    work_cv_.wait_until(lock, first_pending_ + max_delay_,
+                        [this] { return n_pending_ >= max_batch_ || urgent_ > 0; });
+
+    // take the batch, commits arriving from now on go to the next one
+    const ticket batch_to = next_ticket_ - 1;
+    const size_t n_commits = n_pending_;
+    n_pending_ = 0;
+    batch.clear();
+    for (auto &[target, state] : targets_) {
+      if (!state.pending.empty()) {
+        state.syncing = true;
+        batch.push_back(batch_entry{target, state.sync, std::move(state.pending)});
+        state.pending.clear();
+      }
+    }
+
+    lock.unlock();
+    std::vector<std::exception_ptr> failures(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      try {
+        batch[i].sync();
+      } catch (...) {
+        failures[i] = std::current_exception();
+      }
+    }
+    lock.lock();
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+      auto it = targets_.find(batch[i].target);
+      if (it != targets_.end()) {
+        it->second.syncing = false;
+        if (failures[i])
+          it->second.failure = failures[i];
+      }
+      if (failures[i]) {
+        for (ticket t : batch[i].tickets)
+          failed_[t] = failures[i];
+      }
+    }
+    // bounded, fire-and-forget commits never wait for their tickets
+    for (; failed_.size() > MAX_FAILED; failed_.erase(failed_.begin()))
+      forgotten_ = failed_.begin()->first;
+    durable_ = batch_to;
+    ++batches_synced_;
+    commits_synced_ += n_commits;
+    durable_cv_.notify_all();
+  }
+}
+
+} // namespace shilos
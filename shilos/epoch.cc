@@ -0,0 +1,103 @@
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shilos/epoch.hh"
+
+namespace shilos {
+
+#ifdef __linux__
+
+bool asymmetric_fences() {
+  static const bool available = [] {
+    const long cmds = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    return cmds != -1 && (cmds & MEMBARRIER_CMD_GLOBAL) != 0;
+  }();
+  return available;
+}
+
+void heavy_fence() {
+  if (asymmetric_fences() && syscall(SYS_membarrier, MEMBARRIER_CMD_GLOBAL, 0, 0) == 0)
+    return;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+#else
+
+bool asymmetric_fences() { return false; }
+
+void heavy_fence() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+
+#endif
+
+namespace {
+
+// start time of a process, in clock ticks since boot, field 22 of /proc/<pid>/stat, 0 if unknown
+uint64_t start_time_of(uint32_t pid) {
+#ifdef __linux__
+  char path[32], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%u/stat", pid);
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  // the command name (field 2) may contain spaces and parentheses, fields resume after its last ')'
+  const char *p = strrchr(buf, ')');
+  if (!p)
+    return 0;
+  for (int field = 2; field < 22; ++field) { // to the space before field + 1
+    p = strchr(p + 1, ' ');
+    if (!p)
+      return 0;
+  }
+  return strtoull(p + 1, nullptr, 10);
+#else
+  (void)pid;
+  return 0;
+#endif
+}
+
+} // namespace
+
+bool process_dead(uint32_t pid, uint64_t start_time) {
+  if (pid == 0)
+    return false;
+  if (kill(pid_t(pid), 0) == -1 && errno == ESRCH)
+    return true;
+  // alive, or at least its pid is, by another process if it started at another time
+  if (start_time == 0)
+    return false;
+  const uint64_t now_start = start_time_of(pid);
+  return now_start != 0 && now_start != start_time;
+}
+
+uint32_t current_pid() { return uint32_t(getpid()); }
+
+uint64_t current_start_time() {
+  // per process, forked children get their own
+  static std::atomic<uint32_t> cached_pid{0};
+  static std::atomic<uint64_t> cached{0};
+  const uint32_t pid = current_pid();
+  if (cached_pid.load(std::memory_order_acquire) != pid) {
+    cached.store(start_time_of(pid), std::memory_order_relaxed);
+    cached_pid.store(pid, std::memory_order_release);
+  }
+  return cached.load(std::memory_order_relaxed);
+}
+
+} // namespace shilos
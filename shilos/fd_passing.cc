@@ -0,0 +1,78 @@
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "shilos/fd_passing.hh"
+
+namespace shilos {
+
+void send_fd(int socket, int fd) {
+  char payload = 'F';
+  iovec iov{&payload, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  std::memset(control, 0, sizeof(control));
+
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while (sendmsg(socket, &msg, 0) == -1) {
+    if (errno != EINTR)
+      throw std::system_error(errno, std::system_category(), "Failed to send fd over socket");
+  }
+}
+
+int recv_fd(int socket) {
+  char payload;
+  iovec iov{&payload, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+#ifdef MSG_CMSG_CLOEXEC
+  const int flags = MSG_CMSG_CLOEXEC;
+#else
+  const int flags = 0;
+#endif
+  ssize_t n;
+  while ((n = recvmsg(socket, &msg, flags)) == -1) {
+    if (errno != EINTR)
+      throw std::system_error(errno, std::system_category(), "Failed to receive fd over socket");
+  }
+  if (n == 0) {
+    throw std::runtime_error("Peer closed socket before sending fd");
+  }
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      int fd;
+      std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+      return fd;
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    throw std::runtime_error("Truncated control message receiving fd");
+  }
+  throw std::runtime_error("Message received without fd");
+}
+
+} // namespace shilos
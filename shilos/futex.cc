@@ -0,0 +1,63 @@
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <system_error>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "shilos/futex.hh"
+
+namespace shilos {
+
+#ifdef __linux__
+
+bool futex_wait(const uint32_t *addr, uint32_t expected, std::chrono::nanoseconds timeout) {
+  timespec ts, *tsp = nullptr;
+  if (timeout.count() >= 0) {
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    tsp = &ts;
+  }
+  // not FUTEX_PRIVATE_FLAG, the word is in memory shared with other processes
+  if (syscall(SYS_futex, addr, FUTEX_WAIT, expected, tsp, nullptr, 0) == -1) {
+    switch (errno) {
+    case ETIMEDOUT:
+      return false;
+    case EAGAIN: // the word changed already
+    case EINTR:
+      return true;
+    default:
+      throw std::system_error(errno, std::system_category(), "futex wait failed");
+    }
+  }
+  return true;
+}
+
+void futex_wake(const uint32_t *addr, int n) { syscall(SYS_futex, addr, FUTEX_WAKE, n, nullptr, nullptr, 0); }
+
+#else
+
+bool futex_wait(const uint32_t *addr, uint32_t expected, std::chrono::nanoseconds timeout) {
+  constexpr std::chrono::nanoseconds POLL_INTERVAL = std::chrono::microseconds(100);
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  std::atomic_ref<uint32_t> word(*const_cast<uint32_t *>(addr));
+  while (word.load(std::memory_order_acquire) == expected) {
+    if (timeout.count() >= 0 && std::chrono::steady_clock::now() >= deadline)
+      return false;
+    std::this_thread::sleep_for(POLL_INTERVAL);
+  }
+  return true;
+}
+
+void futex_wake(const uint32_t *, int) {}
+
+#endif
+
+} // namespace shilos
@@ -0,0 +1,205 @@
+
+#include <cassert>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "shilos/region_pool.hh"
+
+namespace shilos {
+
+struct region_pool::entry {
+  file_key key;
+  int fd;
+  void *addr;
+  size_t size;
+
+  // for cheap revalidation, the key holds the identity of the mapped file
+  struct timespec mtime;
+
+  size_t refs;
+  bool detached; // stale, unmapped when the last handle releases it
+
+  // links of the LRU list, while unreferenced
+  entry *prev;
+  entry *next;
+};
+
+namespace {
+
+struct timespec mtime_of(const struct stat &st) {
+#ifdef __APPLE__
+  return st.st_mtimespec;
+#else
+  return st.st_mtim;
+#endif
+}
+
+} // namespace
+
+region_pool &region_pool::instance() {
+  // never destroyed, handles may well outlive static destruction
+  static region_pool *pool = new region_pool();
+  return *pool;
+}
+
+void *region_pool::mapped_addr(const entry *e) { return e->addr; }
+size_t region_pool::mapped_size(const entry *e) { return e->size; }
+bool region_pool::writable(const entry *e) { return e->key.writable; }
+
+void region_pool::push_front(entry *e) {
+  e->prev = nullptr;
+  e->next = head_;
+  if (head_)
+    head_->prev = e;
+  else
+    tail_ = e;
+  head_ = e;
+}
+
+void region_pool::unlink(entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    head_ = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    tail_ = e->prev;
+  e->prev = e->next = nullptr;
+}
+
+void region_pool::unmap(entry *e) {
+  munmap(e->addr, e->size);
+  close(e->fd);
+  mapped_bytes_ -= e->size;
+  delete e;
+}
+
+// take a stale entry out of the index, unmapping it now if unreferenced, or once its last handle is released
+void region_pool::drop_locked(entry *e) {
+  index_.erase(e->key);
+  if (e->refs == 0) {
+    unlink(e);
+    unmap(e);
+  } else {
+    e->detached = true;
+  }
+}
+
+void region_pool::evict_locked(size_t budget) {
+  // only unreferenced entries are in the LRU list
+  while (mapped_bytes_ > budget && tail_) {
+    entry *e = tail_;
+    unlink(e);
+    index_.erase(e->key);
+    unmap(e);
+  }
+}
+
+region_pool::entry *region_pool::acquire(const std::string &file_name, bool writable, size_t min_size) {
+  struct stat statbuf;
+  if (stat(file_name.c_str(), &statbuf) == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to stat file: " + file_name);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto fresh = [writable](const entry *e, const struct stat &st) {
+    // a writable mapping bumps the mtime by itself, and MAP_SHARED keeps it coherent with other writers anyway
+    const struct timespec mtime = mtime_of(st);
+    return e->size == size_t(st.st_size) &&
+           (writable || (e->mtime.tv_sec == mtime.tv_sec && e->mtime.tv_nsec == mtime.tv_nsec));
+  };
+  auto take = [this](entry *e) {
+    if (e->refs++ == 0)
+      unlink(e); // referenced entries are not evictable
+    return e;
+  };
+
+  if (auto it = index_.find(file_key{uint64_t(statbuf.st_dev), uint64_t(statbuf.st_ino), writable});
+      it != index_.end()) {
+    if (fresh(it->second, statbuf))
+      return take(it->second);
+    drop_locked(it->second);
+  }
+
+  int fd = ::open(file_name.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "Failed to open file: " + file_name);
+  }
+  // stat again via the fd, the file may have been replaced in between
+  if (fstat(fd, &statbuf) == -1) {
+    close(fd);
+    throw std::system_error(errno, std::system_category(), "Failed to stat file: " + file_name);
+  }
+  const file_key key{uint64_t(statbuf.st_dev), uint64_t(statbuf.st_ino), writable};
+  if (auto it = index_.find(key); it != index_.end()) { // the replacement is mapped already
+    if (fresh(it->second, statbuf)) {
+      close(fd);
+      return take(it->second);
+    }
+    drop_locked(it->second);
+  }
+  if (size_t(statbuf.st_size) < min_size) {
+    close(fd);
+    throw std::runtime_error("File too small to be a DBMR: " + file_name);
+  }
+  const size_t file_size = statbuf.st_size;
+  void *mapped_addr = mmap(nullptr, file_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped_addr == MAP_FAILED) {
+    close(fd);
+    throw std::system_error(errno, std::system_category(), "Failed to mmap file: " + file_name);
+  }
+
+  entry *e = new entry{key, fd, mapped_addr, file_size, mtime_of(statbuf), 1, false, nullptr, nullptr};
+  index_.emplace(key, e);
+  mapped_bytes_ += file_size;
+
+  evict_locked(budget_);
+  return e;
+}
+
+void region_pool::release(entry *e) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  assert(e->refs > 0);
+  if (--e->refs > 0)
+    return;
+  if (e->detached) {
+    unmap(e);
+    return;
+  }
+  push_front(e);
+  evict_locked(budget_);
+}
+
+void region_pool::set_budget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ = bytes;
+  evict_locked(budget_);
+}
+
+size_t region_pool::budget() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return budget_;
+}
+
+size_t region_pool::mapped_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return mapped_bytes_;
+}
+
+size_t region_pool::cached_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index_.size();
+}
+
+void region_pool::purge() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  evict_locked(0);
+}
+
+} // namespace shilos
@@ -0,0 +1,148 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include "shilos/region_stream.hh"
+
+namespace shilos {
+
+namespace {
+
+constexpr size_t BUFFER_ALIGN = 4096;
+
+size_t round_up(size_t n, size_t unit) { return (n + unit - 1) / unit * unit; }
+
+void drop_cached(int fd, size_t begin, size_t end) {
+#ifdef POSIX_FADV_DONTNEED
+  if (end > begin)
+    posix_fadvise(fd, begin, end - begin, POSIX_FADV_DONTNEED);
+#endif
+}
+
+} // namespace
+
+stream_reader::stream_reader(const std::string &file_name, size_t end, const stream_options &opts)
+    : file_name_(file_name), io_(opts.io), fd_(bulk_io::open_file(file_name, O_RDONLY, opts.io)), end_(end),
+      opts_(opts), carry_room_(round_up(opts.buffer_size, BUFFER_ALIGN)) {
+  if (opts_.buffer_size == 0) {
+    close(fd_);
+    throw std::invalid_argument("!?streaming with zero buffer size?!");
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (!opts_.io.direct)
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  // one being consumed, one being filled, and those read ahead
+  const int n_buffers = int(opts_.read_ahead) + 2;
+  for (int i = 0; i < n_buffers; ++i) {
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, BUFFER_ALIGN, carry_room_ + opts_.buffer_size) != 0) {
+      for (auto &buf : buffers_)
+        free(buf.mem);
+      close(fd_);
+      throw std::bad_alloc();
+    }
+    buffers_.push_back(buffer{static_cast<std::byte *>(ptr)});
+    free_.push_back(i);
+  }
+
+  reader_ = std::thread([this] { read_ahead(); });
+}
+
+stream_reader::~stream_reader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  reader_.join();
+  for (auto &buf : buffers_)
+    free(buf.mem);
+  close(fd_);
+}
+
+void stream_reader::read_ahead() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (size_t pos = 0; pos < end_;) {
+    cv_.wait(lock, [this] { return stop_ || !free_.empty(); });
+    if (stop_)
+      break;
+    const int idx = free_.front();
+    free_.pop_front();
+    buffer &buf = buffers_[idx];
+    buf.pos = pos;
+    buf.len = std::min(opts_.buffer_size, end_ - pos);
+
+    lock.unlock();
+    try {
+      io_.read(fd_, buf.mem + carry_room_, buf.len, buf.pos);
+    } catch (...) {
+      lock.lock();
+      failure_ = std::current_exception();
+      break;
+    }
+    lock.lock();
+
+    ready_.push_back(idx);
+    pos += buf.len;
+    cv_.notify_all();
+  }
+  reader_done_ = true;
+  cv_.notify_all();
+}
+
+bool stream_reader::next(stream_chunk &chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !ready_.empty() || reader_done_; });
+  if (ready_.empty()) {
+    if (failure_)
+      std::rethrow_exception(failure_);
+    return false;
+  }
+  const int idx = ready_.front();
+  ready_.pop_front();
+  buffer &buf = buffers_[idx];
+
+  size_t carry = 0;
+  if (current_ >= 0) {
+    const buffer &cur = buffers_[current_];
+    const size_t cur_end = cur.pos + cur.len;
+    carry = cur_end - resume_;
+    std::memcpy(buf.mem + carry_room_ - carry, cur.mem + carry_room_ + cur.len - carry, carry);
+    if (opts_.drop_behind && !opts_.io.direct)
+      drop_cached(fd_, cur.pos, cur_end);
+    free_.push_back(current_);
+    cv_.notify_all();
+  }
+  current_ = idx;
+  current_offset_ = buf.pos - carry;
+  resume_ = buf.pos + buf.len;
+
+  chunk.offset = current_offset_;
+  chunk.data = buf.mem + carry_room_ - carry;
+  chunk.size = carry + buf.len;
+  return true;
+}
+
+void stream_reader::resume_at(size_t offset) {
+  if (current_ < 0) {
+    throw std::logic_error("!?resume_at before any chunk?!");
+  }
+  const buffer &cur = buffers_[current_];
+  const size_t cur_end = cur.pos + cur.len;
+  if (offset < current_offset_ || offset > cur_end) {
+    throw std::out_of_range("!?resume_at outside the current chunk?!");
+  }
+  if (cur_end - offset > carry_room_) {
+    throw std::length_error("!?object straddling chunks larger than the stream buffer?!");
+  }
+  resume_ = offset;
+}
+
+} // namespace shilos
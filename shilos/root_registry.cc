@@ -0,0 +1,32 @@
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shilos/root_registry.hh"
+
+namespace shilos {
+
+bool read_root_type_uuid(const std::string &file_name, UUID &out, std::error_code &ec) noexcept {
+  ec.clear();
+  const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    ec = std::error_code(errno, std::system_category());
+    return false;
+  }
+  // the root type UUID leads every region, whatever its root type
+  uint8_t buf[sizeof(UUID)];
+  ssize_t n;
+  while ((n = pread(fd, buf, sizeof(buf), 0)) == -1 && errno == EINTR) {
+  }
+  if (n == -1)
+    ec = std::error_code(errno, std::system_category());
+  close(fd);
+  if (n != ssize_t(sizeof(buf)))
+    return false;
+  std::memcpy(static_cast<void *>(&out), buf, sizeof(buf));
+  return true;
+}
+
+} // namespace shilos
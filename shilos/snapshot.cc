@@ -0,0 +1,174 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "shilos/snapshot.hh"
+
+namespace shilos {
+
+namespace {
+
+constexpr size_t SCRATCH_SIZE = size_t(1) << 20;
+
+// only async-signal-safe calls from here on, the child of a multithreaded process may not even malloc
+[[noreturn]] void write_image(const char *file_name, const std::byte *base, size_t size, size_t page_size,
+                              const std::byte *preimage, const std::atomic<uint8_t> *flags, std::byte *scratch,
+                              fork_snapshot::image_length_fn image_length) {
+  auto copy_page = [&](size_t page, std::byte *dst) {
+    if (!flags[page].load(std::memory_order_acquire)) {
+      std::memcpy(dst, base + page * page_size, page_size);
+      // pairs with the fence of the write fault handler between saving a page and making it writable
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!flags[page].load(std::memory_order_acquire))
+        return; // not written before the copy completed
+    }
+    std::memcpy(dst, preimage + page * page_size, page_size);
+  };
+
+  const int fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd == -1)
+    _exit(errno & 0xff ? errno & 0xff : EIO);
+  auto fail = [fd](int err) {
+    close(fd);
+    _exit(err & 0xff ? err & 0xff : EIO);
+  };
+
+  copy_page(0, scratch);
+  const size_t length = image_length ? std::min(image_length(scratch), size) : size;
+  const size_t pages_per_batch = SCRATCH_SIZE / page_size;
+  for (size_t pos = 0; pos < length;) {
+    const size_t first = pos / page_size;
+    const size_t n = std::min(pages_per_batch, (length - pos + page_size - 1) / page_size);
+    for (size_t i = pos == 0 ? 1 : 0; i < n; ++i)
+      copy_page(first + i, scratch + i * page_size);
+    const size_t batch = std::min(n * page_size, length - pos);
+    for (size_t done = 0; done < batch;) {
+      const ssize_t rc = pwrite(fd, scratch + done, batch - done, pos + done);
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        fail(errno);
+      }
+      done += rc;
+    }
+    pos += batch;
+  }
+  // the free tail left sparse
+  if (ftruncate(fd, size) == -1 || fsync(fd) == -1)
+    fail(errno);
+  close(fd);
+  _exit(0);
+}
+
+} // namespace
+
+fork_snapshot::fork_snapshot(dirty_tracker &tracker, const std::string &file_name, image_length_fn image_length)
+    : tracker_(tracker), file_name_(file_name),
+      n_pages_((tracker.size() + dirty_tracker::page_size() - 1) / dirty_tracker::page_size()),
+      preimage_(static_cast<std::byte *>(MAP_FAILED)), flags_(static_cast<std::atomic<uint8_t> *>(MAP_FAILED)),
+      scratch_(static_cast<std::byte *>(MAP_FAILED)) {
+  static_assert(sizeof(std::atomic<uint8_t>) == 1 && std::atomic<uint8_t>::is_always_lock_free);
+  const size_t page_size = dirty_tracker::page_size();
+
+  // shared with the child, and only pages written during the snapshot get memory
+  void *ptr = mmap(nullptr, n_pages_ * page_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+                   -1, 0);
+  if (ptr != MAP_FAILED) {
+    preimage_ = static_cast<std::byte *>(ptr);
+    ptr = mmap(nullptr, n_pages_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  }
+  if (ptr != MAP_FAILED) {
+    flags_ = static_cast<std::atomic<uint8_t> *>(ptr);
+    ptr = mmap(nullptr, SCRATCH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (ptr == MAP_FAILED) {
+    const int err = errno;
+    unmap();
+    throw std::system_error(err, std::system_category(), "Failed to map snapshot buffers for file: " + file_name);
+  }
+  scratch_ = static_cast<std::byte *>(ptr);
+
+  tracker_.begin_snapshot(preimage_, flags_);
+  pid_ = fork();
+  if (pid_ == 0) {
+    write_image(file_name_.c_str(), static_cast<const std::byte *>(tracker_.base()), tracker_.size(), page_size,
+                preimage_, flags_, scratch_, image_length);
+  }
+  if (pid_ == -1) {
+    const int err = errno;
+    tracker_.end_snapshot();
+    unmap();
+    throw std::system_error(err, std::system_category(), "Failed to fork for snapshot file: " + file_name);
+  }
+}
+
+fork_snapshot::~fork_snapshot() {
+  if (reaped_)
+    return;
+  try {
+    wait();
+  } catch (const std::exception &exc) {
+    std::cerr << "*** Failed to snapshot: " << exc.what() << std::endl;
+  }
+}
+
+void fork_snapshot::unmap() {
+  if (preimage_ != MAP_FAILED)
+    munmap(preimage_, n_pages_ * dirty_tracker::page_size());
+  if (flags_ != MAP_FAILED)
+    munmap(flags_, n_pages_);
+  if (scratch_ != MAP_FAILED)
+    munmap(scratch_, SCRATCH_SIZE);
+  preimage_ = static_cast<std::byte *>(MAP_FAILED);
+  flags_ = static_cast<std::atomic<uint8_t> *>(MAP_FAILED);
+  scratch_ = static_cast<std::byte *>(MAP_FAILED);
+}
+
+void fork_snapshot::reaped(int status) {
+  reaped_ = true;
+  status_ = status;
+  tracker_.end_snapshot();
+  unmap();
+}
+
+bool fork_snapshot::finished() {
+  if (reaped_)
+    return true;
+  int status;
+  const pid_t rc = waitpid(pid_, &status, WNOHANG);
+  if (rc == 0)
+    return false;
+  // ECHILD when SIGCHLD is ignored and the child got reaped by the kernel, its result is unknown then
+  reaped(rc == pid_ ? status : -1);
+  return true;
+}
+
+void fork_snapshot::wait() {
+  if (!reaped_) {
+    int status;
+    pid_t rc;
+    while ((rc = waitpid(pid_, &status, 0)) == -1 && errno == EINTR)
+      ;
+    reaped(rc == pid_ ? status : -1);
+  }
+  if (status_ == -1) {
+    throw std::system_error(ECHILD, std::system_category(), "Lost snapshot child for file: " + file_name_);
+  }
+  if (!WIFEXITED(status_)) {
+    throw std::system_error(EINTR, std::system_category(), "Snapshot child killed for file: " + file_name_);
+  }
+  if (WEXITSTATUS(status_) != 0) {
+    throw std::system_error(WEXITSTATUS(status_), std::system_category(),
+                            "Failed to write snapshot file: " + file_name_);
+  }
+}
+
+} // namespace shilos
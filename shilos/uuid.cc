@@ -0,0 +1,39 @@
+
+#include <chrono>
+#include <random>
+#include <thread>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "shilos/uuid.hh"
+
+namespace shilos {
+
+std::atomic<uint64_t> uuid_fork_generation{0};
+
+#ifndef _WIN32
+static const int uuid_atfork_registered = pthread_atfork(nullptr, nullptr, [] {
+  uuid_fork_generation.fetch_add(1, std::memory_order_relaxed);
+});
+#endif
+
+void uuid_generator::reseed() {
+  // splitmix64 over the entropy gathered, so the xoshiro state is well mixed and never all zero
+  std::random_device rd;
+  uint64_t seed = (uint64_t(rd()) << 32) ^ rd();
+  seed ^= uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+  seed ^= uint64_t(std::hash<std::thread::id>{}(std::this_thread::get_id())) << 1;
+  for (auto &s : s_) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    s = z ^ (z >> 31);
+  }
+  generation_ = uuid_fork_generation.load(std::memory_order_relaxed);
+  last_ms_ = 0;
+  counter_ = 0;
+}
+
+} // namespace shilos
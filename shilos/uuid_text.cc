@@ -0,0 +1,211 @@
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <tmmintrin.h>
+#endif
+
+#include "shilos/uuid_text.hh"
+
+namespace shilos {
+
+static_assert(sizeof(UUID) == 16 && std::is_trivially_copyable_v<UUID>, "UUIDs are converted as 16 raw bytes");
+
+namespace {
+
+constexpr size_t TEXT_SIZE = 36;
+
+constexpr std::array<uint8_t, 256> make_hex_values() {
+  std::array<uint8_t, 256> values{};
+  for (auto &v : values)
+    v = 0xFF;
+  for (int c = '0'; c <= '9'; ++c)
+    values[c] = uint8_t(c - '0');
+  for (int c = 'A'; c <= 'F'; ++c)
+    values[c] = values[c + ('a' - 'A')] = uint8_t(c - 'A' + 10);
+  return values;
+}
+
+constexpr auto HEX_VALUES = make_hex_values();
+constexpr char HEX_DIGITS[] = "0123456789ABCDEF";
+
+bool hyphens_ok(const char *p) { return p[8] == '-' && p[13] == '-' && p[18] == '-' && p[23] == '-'; }
+
+uuid_errc parse_scalar(const char *p, uint8_t *bytes) {
+  if (!hyphens_ok(p))
+    return uuid_errc::bad_hyphen;
+  uint8_t bad = 0;
+  size_t i = 0;
+  for (size_t b = 0; b < 16; ++b) {
+    if (i == 8 || i == 13 || i == 18 || i == 23)
+      ++i;
+    const uint8_t hi = HEX_VALUES[uint8_t(p[i])], lo = HEX_VALUES[uint8_t(p[i + 1])];
+    bad |= hi | lo; // any 0xFF sets the high bits
+    bytes[b] = uint8_t(hi << 4 | lo);
+    i += 2;
+  }
+  return bad & 0xF0 ? uuid_errc::bad_hex : uuid_errc::ok;
+}
+
+void format_scalar(const uint8_t *bytes, char *out) {
+  size_t o = 0;
+  for (size_t b = 0; b < 16; ++b) {
+    out[o++] = HEX_DIGITS[bytes[b] >> 4];
+    out[o++] = HEX_DIGITS[bytes[b] & 0x0F];
+    if (b == 3 || b == 5 || b == 7 || b == 9)
+      out[o++] = '-';
+  }
+}
+
+#if defined(__x86_64__)
+
+// gathers the 32 hex digits out of the 36 characters, in two halves: digits 0-15 from characters 0-15 and 16-17, and
+// digits 16-31 from characters 16-31 and 32-35 (loaded from 20, to stay within the 36)
+
+__attribute__((target("ssse3"))) bool parse_ssse3(const char *p, uint8_t *bytes) {
+  const __m128i c0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  const __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+  const __m128i c2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 20));
+  const __m128i d0 = _mm_or_si128(
+      _mm_shuffle_epi8(c0, _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 9, 10, 11, 12, 14, 15, -1, -1)),
+      _mm_shuffle_epi8(c1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1)));
+  const __m128i d1 = _mm_or_si128(
+      _mm_shuffle_epi8(c1, _mm_setr_epi8(3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1)),
+      _mm_shuffle_epi8(c2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 12, 13, 14, 15)));
+
+  // '0'-'9' map to 0-9 and 'a'-'f' (case folded) to 10-15, anything else fails the range checks
+  auto nibbles = [](__m128i d, __m128i &valid) __attribute__((target("ssse3"))) {
+    const __m128i digit = _mm_sub_epi8(d, _mm_set1_epi8('0'));
+    const __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    const __m128i alpha = _mm_sub_epi8(_mm_or_si128(d, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    valid = _mm_and_si128(valid, _mm_or_si128(is_digit, is_alpha));
+    return _mm_or_si128(_mm_and_si128(is_digit, digit),
+                        _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+  };
+  __m128i valid = _mm_set1_epi8(char(0xFF));
+  const __m128i n0 = nibbles(d0, valid), n1 = nibbles(d1, valid);
+  if (_mm_movemask_epi8(valid) != 0xFFFF)
+    return false;
+
+  // pairs of nibbles to bytes, high * 16 + low, as 16-bit lanes then packed
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  const __m128i packed = _mm_packus_epi16(_mm_maddubs_epi16(n0, weights), _mm_maddubs_epi16(n1, weights));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), packed);
+  return true;
+}
+
+__attribute__((target("ssse3"))) void format_ssse3(const uint8_t *bytes, char *out, char *tail) {
+  const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  const __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask), lo = _mm_and_si128(b, mask);
+  const __m128i lut = _mm_loadu_si128(reinterpret_cast<const __m128i *>(HEX_DIGITS));
+  const __m128i h0 = _mm_shuffle_epi8(lut, _mm_unpacklo_epi8(hi, lo)); // digits 0-15
+  const __m128i h1 = _mm_shuffle_epi8(lut, _mm_unpackhi_epi8(hi, lo)); // digits 16-31
+
+  // characters 0-15, 16-31 and 32-35, hyphens at 8, 13, 18 and 23
+  const __m128i o0 = _mm_or_si128(
+      _mm_shuffle_epi8(h0, _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12, 13)),
+      _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, '-', 0, 0, 0, 0, '-', 0, 0));
+  const __m128i o1 = _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(h0, _mm_setr_epi8(14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                   _mm_shuffle_epi8(h1, _mm_setr_epi8(-1, -1, -1, 0, 1, 2, 3, -1, 4, 5, 6, 7, 8, 9, 10, 11))),
+      _mm_setr_epi8(0, 0, '-', 0, 0, 0, 0, '-', 0, 0, 0, 0, 0, 0, 0, 0));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out), o0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), o1);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(tail), h1); // digits 28-31 are its last 4 bytes
+}
+
+bool simd_supported() {
+  static const bool supported = __builtin_cpu_supports("ssse3");
+  return supported;
+}
+
+#endif
+
+} // namespace
+
+const char *to_string(uuid_errc ec) {
+  switch (ec) {
+  case uuid_errc::ok:
+    return "ok";
+  case uuid_errc::too_short:
+    return "UUID text too short";
+  case uuid_errc::bad_hyphen:
+    return "Invalid UUID format";
+  case uuid_errc::bad_hex:
+    return "Invalid hex character in UUID";
+  }
+  return "?";
+}
+
+uuid_errc parse_uuid(std::string_view text, UUID &out) noexcept {
+  if (text.size() < TEXT_SIZE)
+    return uuid_errc::too_short;
+  uint8_t bytes[16];
+#if defined(__x86_64__)
+  if (simd_supported()) {
+    if (!hyphens_ok(text.data()))
+      return uuid_errc::bad_hyphen;
+    if (!parse_ssse3(text.data(), bytes))
+      return uuid_errc::bad_hex;
+    std::memcpy(static_cast<void *>(&out), bytes, 16);
+    return uuid_errc::ok;
+  }
+#endif
+  const uuid_errc ec = parse_scalar(text.data(), bytes);
+  if (ec == uuid_errc::ok)
+    std::memcpy(static_cast<void *>(&out), bytes, 16);
+  return ec;
+}
+
+uuid_parse_result parse_uuids(std::string_view text, std::span<UUID> out, size_t stride) noexcept {
+  if (stride < TEXT_SIZE)
+    stride = TEXT_SIZE;
+  const char *p = text.data();
+  for (size_t i = 0; i < out.size(); ++i, p += stride) {
+    if (size_t(p - text.data()) + TEXT_SIZE > text.size())
+      return {uuid_errc::too_short, i};
+    const uuid_errc ec = parse_uuid(std::string_view(p, TEXT_SIZE), out[i]);
+    if (ec != uuid_errc::ok)
+      return {ec, i};
+  }
+  return {uuid_errc::ok, out.size()};
+}
+
+void format_uuid(const UUID &uuid, char *out) noexcept {
+  uint8_t bytes[16];
+  std::memcpy(bytes, static_cast<const void *>(&uuid), 16);
+#if defined(__x86_64__)
+  if (simd_supported()) {
+    alignas(16) char tail[16];
+    format_ssse3(bytes, out, tail);
+    std::memcpy(out + 32, tail + 12, 4);
+    return;
+  }
+#endif
+  format_scalar(bytes, out);
+}
+
+void format_uuids(std::span<const UUID> in, char *out, size_t stride, char separator) noexcept {
+  if (stride < TEXT_SIZE)
+    stride = TEXT_SIZE;
+  for (const UUID &uuid : in) {
+    format_uuid(uuid, out);
+    std::memset(out + TEXT_SIZE, separator, stride - TEXT_SIZE);
+    out += stride;
+  }
+}
+
+const char *uuid_text_impl() {
+#if defined(__x86_64__)
+  if (simd_supported())
+    return "ssse3";
+#endif
+  return "scalar";
+}
+
+} // namespace shilos